@@ -11,305 +11,5530 @@
 #define _NIX_TCP_HPP
 
 #include <cerrno>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/tcp.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <queue>
+#include <random>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+// Static tracepoints for bpftrace and perf ("usdt:...:nix_tcp:<name>")
+//
+// They compile down to a single nop when <sys/sdt.h> is available, and to
+// nothing at all otherwise or if NIX_TCP_NO_USDT is defined
+#if !defined(NIX_TCP_NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NIX_TCP_PROBE(name, ...) STAP_PROBEV(nix_tcp, name, ##__VA_ARGS__)
+#else
+#define NIX_TCP_PROBE(name, ...) \
+    do {                         \
+    } while (0)
+#endif
+
+// Versions of the hot loops for wider instruction sets, picked at runtime
+// (see TcpCpu), are built on x86 unless NIX_TCP_NO_DISPATCH is defined
+#if !defined(NIX_TCP_NO_DISPATCH) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define NIX_TCP_DISPATCH
+#define NIX_TCP_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// Counters, gauges and latency histograms aggregated over every socket and
+// server, unless NIX_TCP_NO_METRICS is defined
+//
+// Values are spread over cache line sized shards picked per thread and only
+// summed when read, so updating them never contends or blocks
+class TcpMetrics {
+  public:
+    enum Counter {
+        connections_opened,
+        connections_closed,
+        messages_sent,
+        messages_received,
+        bytes_sent,
+        bytes_received,
+        syscalls,
+        errors,
+        // Requests shed by a queue for waiting too long
+        requests_dropped,
+        // Requests turned away by a concurrency limit or a full queue
+        requests_rejected,
+        counters,
+    };
+    enum Gauge {
+        // Messages waiting in the outbound queues of sockets
+        queued_messages,
+        // Bytes waiting to be written on server connections
+        pending_output_bytes,
+        gauges,
+    };
+    enum Histogram {
+        // Time for a message to be written, queueing included
+        send_latency,
+        // Time for a message to be received, from its first packet on
+        recv_latency,
+        // Time between the kernel receiving a message and it being read,
+        // with timestamping enabled
+        rx_kernel_latency,
+        // Time between a message being written and it leaving the host, with
+        // timestamping enabled
+        tx_wire_latency,
+        // Time between a message being written and it being acknowledged by
+        // the peer, with timestamping enabled
+        tx_ack_latency,
+        histograms,
+    };
+
+#ifdef NIX_TCP_NO_METRICS
+    static constexpr bool enabled = false;
+#else
+    static constexpr bool enabled = true;
+#endif
+
+    // Histogram buckets go from 1us to about 1s, doubling every time
+    static constexpr size_t buckets = 21;
+
+  private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[Counter::counters];
+        std::atomic<int64_t> gauges[Gauge::gauges];
+        std::atomic<uint64_t> bucket_counts[Histogram::histograms][buckets + 1];
+        std::atomic<uint64_t> sums[Histogram::histograms];
+    };
+
+    static constexpr size_t shard_count = 16;
+    static inline Shard shards[shard_count];
+
+    static Shard& shard() {
+        static std::atomic<size_t> next_shard(0);
+        thread_local size_t index = next_shard++ % shard_count;
+        return shards[index];
+    }
+
+  public:
+    static void add(Counter counter, uint64_t value = 1) {
+        if (enabled) {
+            shard().counters[counter].fetch_add(value,
+                                                std::memory_order_relaxed);
+        }
+    }
+
+    static void adjust(Gauge gauge, int64_t delta) {
+        if (enabled) {
+            shard().gauges[gauge].fetch_add(delta, std::memory_order_relaxed);
+        }
+    }
+
+    static void observe(Histogram histogram, std::chrono::nanoseconds value) {
+        if (enabled) {
+            uint64_t ns = std::max(value.count(), (int64_t)0);
+            // Index of the first power of two microseconds the value doesn't
+            // exceed, which is the bit width of the microseconds minus one
+            auto us = (ns + 999) / 1000;
+            size_t bucket = 0;
+            for (auto rest = us > 0 ? us - 1 : 0; rest > 0 && bucket < buckets;
+                 rest >>= 1) {
+                bucket++;
+            }
+
+            auto& shard = TcpMetrics::shard();
+            shard.bucket_counts[histogram][bucket].fetch_add(
+                1, std::memory_order_relaxed);
+            shard.sums[histogram].fetch_add(ns, std::memory_order_relaxed);
+        }
+    }
+
+    static uint64_t read(Counter counter) {
+        uint64_t total = 0;
+        for (auto& shard : shards) {
+            total += shard.counters[counter].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    static int64_t read(Gauge gauge) {
+        int64_t total = 0;
+        for (auto& shard : shards) {
+            total += shard.gauges[gauge].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Render every metric in the OpenMetrics text format
+    static std::string render() {
+        static char const* counter_names[] = {
+            "connections_opened", "connections_closed", "messages_sent",
+            "messages_received",  "bytes_sent",         "bytes_received",
+            "syscalls",           "errors",             "requests_dropped",
+            "requests_rejected",
+        };
+        static char const* gauge_names[] = {
+            "queued_messages",
+            "pending_output_bytes",
+        };
+        static char const* histogram_names[] = {
+            "send_latency_seconds",      "recv_latency_seconds",
+            "rx_kernel_latency_seconds", "tx_wire_latency_seconds",
+            "tx_ack_latency_seconds",
+        };
+
+        std::string out;
+        char line[256];
+
+        for (size_t i = 0; i < Counter::counters; i++) {
+            snprintf(line, sizeof line,
+                     "# TYPE nix_tcp_%s counter\nnix_tcp_%s_total %llu\n",
+                     counter_names[i], counter_names[i],
+                     (unsigned long long)read((Counter)i));
+            out += line;
+        }
+
+        for (size_t i = 0; i < Gauge::gauges; i++) {
+            snprintf(line, sizeof line,
+                     "# TYPE nix_tcp_%s gauge\nnix_tcp_%s %lld\n",
+                     gauge_names[i], gauge_names[i],
+                     (long long)read((Gauge)i));
+            out += line;
+        }
+
+        for (size_t i = 0; i < Histogram::histograms; i++) {
+            auto name = histogram_names[i];
+            snprintf(line, sizeof line, "# TYPE nix_tcp_%s histogram\n", name);
+            out += line;
+
+            uint64_t count = 0;
+            uint64_t sum = 0;
+            for (size_t bucket = 0; bucket <= buckets; bucket++) {
+                for (auto& shard : shards) {
+                    count += shard.bucket_counts[i][bucket].load(
+                        std::memory_order_relaxed);
+                }
+                if (bucket < buckets) {
+                    snprintf(line, sizeof line,
+                             "nix_tcp_%s_bucket{le=\"%g\"} %llu\n", name,
+                             (double)(1ull << bucket) / 1e6,
+                             (unsigned long long)count);
+                } else {
+                    snprintf(line, sizeof line,
+                             "nix_tcp_%s_bucket{le=\"+Inf\"} %llu\n", name,
+                             (unsigned long long)count);
+                }
+                out += line;
+            }
+            for (auto& shard : shards) {
+                sum += shard.sums[i].load(std::memory_order_relaxed);
+            }
+
+            snprintf(line, sizeof line,
+                     "nix_tcp_%s_sum %g\nnix_tcp_%s_count %llu\n", name,
+                     (double)sum / 1e9, name, (unsigned long long)count);
+            out += line;
+        }
+
+        out += "# EOF\n";
+        return out;
+    }
+};
+
 // Error type used by the wrapper
 struct TcpError {
     int code;
     std::string message;
+
+    TcpError(int code, std::string message)
+        : code(code), message(std::move(message)) {
+        NIX_TCP_PROBE(error, this->code, this->message.c_str());
+        TcpMetrics::add(TcpMetrics::errors);
+    }
+};
+
+// Instruction sets code paths can be picked from at runtime
+//
+// Kernels come in a baseline version and in versions using wider instruction
+// sets, the best one the CPU supports being picked once, at first use.
+// Setting NIX_TCP_ISA to "baseline", "sse4.2" or "avx2" caps the level, to
+// compare them
+class TcpCpu {
+  public:
+    enum Level : uint8_t {
+        baseline,
+        sse42,
+        avx2,
+    };
+
+    static char const* name(Level level) {
+        switch (level) {
+        case sse42:
+            return "sse4.2";
+        case avx2:
+            return "avx2";
+        default:
+            return "baseline";
+        }
+    }
+
+    // Highest level the CPU supports
+    static Level supported() {
+        auto level = baseline;
+#ifdef NIX_TCP_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) {
+            level = sse42;
+            if (__builtin_cpu_supports("avx2")) {
+                level = avx2;
+            }
+        }
+#endif
+        return level;
+    }
+
+    // Level kernels are picked for
+    static Level level() {
+        static Level level = [] {
+            auto level = supported();
+            auto cap = std::getenv("NIX_TCP_ISA");
+            for (auto i : {baseline, sse42, avx2}) {
+                if (cap != nullptr && std::strcmp(cap, name(i)) == 0) {
+                    level = std::min(level, i);
+                }
+            }
+            return level;
+        }();
+        return level;
+    }
+};
+
+// Hot loops of the library, in a version per instruction set
+struct TcpKernels {
+    // Write at most "max_packets" packets of the "size" bytes of "data"
+    // starting at "offset" to "out", advancing "offset", and return the
+    // number of bytes written
+    size_t (*encode)(uint8_t packet_len, uint8_t const* data, size_t size,
+                     size_t& offset, size_t max_packets, uint8_t* out);
+    // Strip the chunk lengths of the "packets" packets at "data" carrying a
+    // message of "size" bytes, in place, and return whether they all had the
+    // expected length
+    bool (*strip)(uint8_t packet_len, uint8_t* data, size_t packets,
+                  size_t size);
+    // CRC-32C (Castagnoli) of "len" bytes
+    uint32_t (*crc32c)(uint8_t const* data, size_t len);
+
+    // Kernels for TcpCpu::level
+    static TcpKernels const& get() {
+        static TcpKernels kernels = pick(TcpCpu::level());
+        return kernels;
+    }
+
+    // Kernels for a level, which the CPU must support
+    static TcpKernels pick(TcpCpu::Level level) {
+        TcpKernels kernels = {encode_baseline, strip_baseline,
+                              crc32c_baseline};
+#ifdef NIX_TCP_DISPATCH
+        if (level >= TcpCpu::sse42) {
+            kernels.crc32c = crc32c_sse42;
+        }
+        if (level >= TcpCpu::avx2) {
+            kernels.encode = encode_avx2;
+            kernels.strip = strip_avx2;
+        }
+#else
+        (void)level;
+#endif
+        return kernels;
+    }
+
+  private:
+    static size_t encode_baseline(uint8_t packet_len, uint8_t const* data,
+                                  size_t size, size_t& offset,
+                                  size_t max_packets, uint8_t* out) {
+        size_t payload_len = packet_len - 1;
+
+        size_t len = 0;
+        for (size_t n = 0; n < max_packets && offset < size; n++) {
+            auto packet = out + len;
+            uint8_t count = std::min(payload_len, size - offset);
+
+            // Write the chunk length at the beginning of the packet
+            packet[0] = count;
+            // Fill the rest of the packet with the chunk, and pad it
+            std::memcpy(packet + 1, data + offset, count);
+            std::memset(packet + 1 + count, 0, payload_len - count);
+
+            offset += count;
+            len += packet_len;
+        }
+
+        return len;
+    }
+
+    static bool strip_baseline(uint8_t packet_len, uint8_t* data,
+                               size_t packets, size_t size) {
+        size_t payload_len = packet_len - 1;
+
+        // Chunks only ever move towards the beginning of the buffer
+        for (size_t i = 0; i < packets; i++) {
+            auto chunk = std::min(payload_len, size - i * payload_len);
+            if (data[i * packet_len] != chunk) {
+                return false;
+            }
+            std::memmove(data + i * payload_len, data + i * packet_len + 1,
+                         chunk);
+        }
+        return true;
+    }
+
+    static uint32_t crc32c_baseline(uint8_t const* data, size_t len) {
+        static auto const table = [] {
+            std::array<uint32_t, 256> table;
+            for (uint32_t i = 0; i < 256; i++) {
+                auto crc = i;
+                for (auto bit = 0; bit < 8; bit++) {
+                    crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+                }
+                table[i] = crc;
+            }
+            return table;
+        }();
+
+        uint32_t crc = ~0u;
+        for (size_t i = 0; i < len; i++) {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+#ifdef NIX_TCP_DISPATCH
+    // Copy a chunk, which may move it to a lower overlapping address
+    //
+    // Every byte is loaded before anything overlapping it is stored, which
+    // lets a chunk be copied with a few wide moves instead of a call
+    NIX_TCP_TARGET("avx2")
+    static inline void copy_avx2(uint8_t* out, uint8_t const* in, size_t len) {
+        if (len >= 32) {
+            auto tail = _mm256_loadu_si256((__m256i const*)(in + len - 32));
+            for (size_t i = 0; i + 32 < len; i += 32) {
+                _mm256_storeu_si256(
+                    (__m256i*)(out + i),
+                    _mm256_loadu_si256((__m256i const*)(in + i)));
+            }
+            _mm256_storeu_si256((__m256i*)(out + len - 32), tail);
+        } else if (len >= 16) {
+            auto head = _mm_loadu_si128((__m128i const*)in);
+            auto tail = _mm_loadu_si128((__m128i const*)(in + len - 16));
+            _mm_storeu_si128((__m128i*)out, head);
+            _mm_storeu_si128((__m128i*)(out + len - 16), tail);
+        } else {
+            std::memmove(out, in, len);
+        }
+    }
+
+    NIX_TCP_TARGET("avx2")
+    static size_t encode_avx2(uint8_t packet_len, uint8_t const* data,
+                              size_t size, size_t& offset, size_t max_packets,
+                              uint8_t* out) {
+        size_t payload_len = packet_len - 1;
+
+        size_t len = 0;
+        for (size_t n = 0; n < max_packets && offset < size; n++) {
+            auto packet = out + len;
+            uint8_t count = std::min(payload_len, size - offset);
+
+            packet[0] = count;
+            copy_avx2(packet + 1, data + offset, count);
+            // Only the last packet of a message needs padding
+            if (count < payload_len) {
+                std::memset(packet + 1 + count, 0, payload_len - count);
+            }
+
+            offset += count;
+            len += packet_len;
+        }
+
+        return len;
+    }
+
+    NIX_TCP_TARGET("avx2")
+    static bool strip_avx2(uint8_t packet_len, uint8_t* data, size_t packets,
+                           size_t size) {
+        size_t payload_len = packet_len - 1;
+
+        for (size_t i = 0; i < packets; i++) {
+            auto chunk = std::min(payload_len, size - i * payload_len);
+            if (data[i * packet_len] != chunk) {
+                return false;
+            }
+            copy_avx2(data + i * payload_len, data + i * packet_len + 1,
+                      chunk);
+        }
+        return true;
+    }
+
+    NIX_TCP_TARGET("sse4.2")
+    static uint32_t crc32c_sse42(uint8_t const* data, size_t len) {
+        uint64_t crc = ~0u;
+        size_t i = 0;
+#ifdef __x86_64__
+        for (; i + 8 <= len; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            crc = _mm_crc32_u64(crc, word);
+        }
+#endif
+        for (; i < len; i++) {
+            crc = _mm_crc32_u8((uint32_t)crc, data[i]);
+        }
+        return ~(uint32_t)crc;
+    }
+#endif
+};
+
+// Splits messages into packets
+//
+// Every packet starts with the length of the chunk of data it carries, and
+// packets carrying less than they could end a message
+//
+// A packet starting with "control", which no chunk length can be since a
+// packet is at most 255 bytes, carries a control message instead. It is sent
+// between two messages, or between two packets of one for urgent messages,
+// and is never seen by peers that didn't opt into the feature using it
+struct TcpPacketEncoder {
+    static constexpr uint8_t control = 0xff;
+
+    // Kind of control packet, in its second byte
+    enum Control : uint8_t {
+        // Packets following this one are "packet[2]" bytes long
+        resize = 1,
+        // The next message is "packet[3..10]" bytes long (little endian), in
+        // version "packet[2]" of the announced format, and ends once that
+        // many bytes were received, whatever its last chunk length
+        announce = 2,
+        // Same as "announce", but sent in the middle of the packets of a
+        // plain message, which resumes once the urgent one was received
+        urgent = 3,
+    };
+
+    static constexpr uint8_t announce_version = 1;
+
+    // Smallest packet lengths able to carry a control packet, and to
+    // announce a message
+    static constexpr uint8_t min_packet_len = 3;
+    static constexpr uint8_t min_announce_len = 11;
+
+    // Number of packets needed to send "size" bytes
+    static size_t packets(uint8_t packet_len, size_t size) {
+        return (size + packet_len - 2) / (packet_len - 1);
+    }
+
+    // Write at most "max_packets" packets of the "size" bytes of "data"
+    // starting at "offset" to "out", advancing "offset", and return the number
+    // of bytes written
+    static size_t encode(uint8_t packet_len, uint8_t const* data, size_t size,
+                         size_t& offset, size_t max_packets, uint8_t* out) {
+        return TcpKernels::get().encode(packet_len, data, size, offset,
+                                        max_packets, out);
+    }
+    static size_t encode(uint8_t packet_len, std::vector<uint8_t> const& data,
+                         size_t& offset, size_t max_packets, uint8_t* out) {
+        return encode(packet_len, data.data(), data.size(), offset,
+                      max_packets, out);
+    }
+
+    // Write a packet telling the receiver that packets following it are
+    // "new_len" bytes long
+    static void encode_resize(uint8_t packet_len, uint8_t new_len,
+                              uint8_t* out) {
+        std::memset(out, 0, packet_len);
+        out[0] = control;
+        out[1] = resize;
+        out[2] = new_len;
+    }
+
+    // Write a packet announcing that the next message is "size" bytes long
+    static void encode_announce(uint8_t packet_len, uint64_t size,
+                                uint8_t* out) {
+        std::memset(out, 0, packet_len);
+        out[0] = control;
+        out[1] = announce;
+        out[2] = announce_version;
+        for (auto i = 0; i < 8; i++) {
+            out[3 + i] = size >> (8 * i);
+        }
+    }
+
+    // Write a packet announcing an urgent message of "size" bytes inside the
+    // message being sent
+    static void encode_urgent(uint8_t packet_len, uint64_t size,
+                              uint8_t* out) {
+        encode_announce(packet_len, size, out);
+        out[1] = urgent;
+    }
+};
+
+// Reassembles messages from a stream of packets received in arbitrary pieces
+class TcpPacketDecoder {
+    uint8_t packet_len;
+    // Largest message accepted
+    size_t max_message;
+    // Message being reassembled
+    std::vector<uint8_t> message;
+    // Size of the message being reassembled, if it was announced
+    std::optional<size_t> announced;
+    // Urgent message interrupting the one being reassembled, and its size
+    std::vector<uint8_t> urgent_message;
+    std::optional<size_t> urgent;
+
+  public:
+    // Largest message accepted unless told otherwise
+    static constexpr size_t default_max_message = (size_t)1 << 30;
+    // Most memory reserved for an announced message before its packets come
+    // in, since the announcement is only the word of the peer
+    static constexpr size_t max_reserve = 1 << 16;
+
+    TcpPacketDecoder(uint8_t packet_len, size_t max_message) {
+        this->packet_len = packet_len;
+        this->max_message = max_message;
+    }
+    TcpPacketDecoder(uint8_t packet_len)
+        : TcpPacketDecoder(packet_len, default_max_message) {}
+
+    // Apply a control packet received between two messages to the length of
+    // the packets following it
+    static void apply(uint8_t& packet_len, uint8_t const* packet) {
+        if (packet[1] != TcpPacketEncoder::resize ||
+            packet[2] < TcpPacketEncoder::min_packet_len) {
+            struct TcpError error = {1, "invalid control packet"};
+            throw error;
+        }
+        packet_len = packet[2];
+    }
+
+    // Size of the message announced by a control packet, which may not be
+    // larger than "max_message"
+    static size_t announced_size(uint8_t packet_len, uint8_t const* packet,
+                                 size_t max_message) {
+        if (packet_len < TcpPacketEncoder::min_announce_len ||
+            packet[2] != TcpPacketEncoder::announce_version) {
+            struct TcpError error = {1, "unsupported message announcement"};
+            throw error;
+        }
+
+        uint64_t size = 0;
+        for (auto i = 0; i < 8; i++) {
+            size |= (uint64_t)packet[3 + i] << (8 * i);
+        }
+        // Bound the size so the packets of the message can always be counted
+        if (size > SIZE_MAX / 256) {
+            struct TcpError error = {1, "invalid announced message size"};
+            throw error;
+        }
+        if (size > max_message) {
+            struct TcpError error = {EMSGSIZE, "message too large"};
+            throw error;
+        }
+        return size;
+    }
+
+    // Decode the whole packets at the beginning of "data", handing every
+    // complete message to "on_message" until "max_messages" were decoded, and
+    // return the number of bytes consumed
+    template <typename F>
+    size_t decode(uint8_t const* data, size_t len, size_t max_messages,
+                  F&& on_message) {
+        size_t offset = 0;
+        size_t messages = 0;
+        while (messages < max_messages && len - offset >= this->packet_len) {
+            auto packet = data + offset;
+            offset += this->packet_len;
+
+            // Extract the chunk length
+            uint8_t count = packet[0];
+            auto interrupting = count == TcpPacketEncoder::control &&
+                                packet[1] == TcpPacketEncoder::urgent &&
+                                !this->urgent.has_value();
+            if (interrupting) {
+                this->urgent = announced_size(this->packet_len, packet,
+                                              this->max_message);
+                this->urgent_message.reserve(
+                    std::min(*this->urgent, max_reserve));
+            }
+
+            // Packets go to the urgent message until it is complete
+            auto& message =
+                this->urgent.has_value() ? this->urgent_message : this->message;
+            auto& announced =
+                this->urgent.has_value() ? this->urgent : this->announced;
+
+            if (interrupting) {
+                // The marker only carries the size of the urgent message
+            } else if (count == TcpPacketEncoder::control && message.empty() &&
+                       !announced.has_value()) {
+                if (packet[1] != TcpPacketEncoder::announce) {
+                    apply(this->packet_len, packet);
+                    continue;
+                }
+                announced = announced_size(this->packet_len, packet,
+                                           this->max_message);
+                message.reserve(std::min(*announced, max_reserve));
+            } else if (count > this->packet_len - 1) {
+                struct TcpError error = {1, "invalid received chunk length"};
+                throw error;
+            } else if (message.size() + count > this->max_message) {
+                struct TcpError error = {EMSGSIZE, "message too large"};
+                throw error;
+            } else {
+                // Append the chunk to the message
+                message.insert(message.end(), packet + 1, packet + 1 + count);
+            }
+
+            // An announced message ends with its last byte, and a plain one
+            // with a chunk shorter than the max length
+            auto done = false;
+            if (announced.has_value()) {
+                auto size = message.size();
+                if (size > *announced ||
+                    (size < *announced && count < this->packet_len - 1)) {
+                    struct TcpError error = {1, "invalid announced message"};
+                    throw error;
+                }
+                done = size == *announced;
+            } else {
+                done = count < this->packet_len - 1;
+            }
+
+            if (done) {
+                messages++;
+                announced = std::nullopt;
+                on_message(std::move(message));
+                message = std::vector<uint8_t>();
+            }
+        }
+
+        return offset;
+    }
+
+    // Memory held by the message being reassembled
+    size_t memory() {
+        return this->message.capacity() + this->urgent_message.capacity();
+    }
+};
+
+// Per connection transport settings, shared by sockets and servers
+struct TcpSocketOptions {
+    // Cap the rate at which the kernel paces out packets, in bytes per second
+    static void set_pacing_rate(int fd, uint64_t rate) {
+        if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                       sizeof rate) == 0) {
+            return;
+        }
+
+        // Older kernels only take a 32 bit rate
+        uint32_t rate32 = std::min(rate, (uint64_t)UINT32_MAX);
+        if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate32,
+                       sizeof rate32) == -1) {
+            struct TcpError error = {errno, "couldn't set pacing rate"};
+            throw error;
+        }
+    }
+
+    // Select the congestion control algorithm ("cubic", "bbr", ...)
+    static void set_congestion_control(int fd, std::string const& name) {
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name.c_str(),
+                       name.size()) == -1) {
+            struct TcpError error = {errno,
+                                     "couldn't set congestion control"};
+            throw error;
+        }
+    }
+
+    // Name of the congestion control algorithm in use
+    static std::string congestion_control(int fd) {
+        // Kernels limit algorithm names to 16 bytes (TCP_CA_NAME_MAX)
+        char name[16];
+        socklen_t len = sizeof name;
+        if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len) == -1) {
+            struct TcpError error = {errno,
+                                     "couldn't get congestion control"};
+            throw error;
+        }
+        return std::string(name, strnlen(name, len));
+    }
+
+    // Kernel statistics of a connection
+    static struct tcp_info info(int fd) {
+        struct tcp_info info;
+        std::memset(&info, 0, sizeof info);
+        socklen_t len = sizeof info;
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+            struct TcpError error = {errno, "couldn't get connection info"};
+            throw error;
+        }
+        return info;
+    }
+
+    // Set the size of the kernel send and receive buffers, which also turns
+    // off the kernel's own tuning of them
+    static void set_buffer_size(int fd, size_t size) {
+        int value = std::min(size, (size_t)INT32_MAX);
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof value) ==
+                -1 ||
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, sizeof value) ==
+                -1) {
+            struct TcpError error = {errno, "couldn't set buffer sizes"};
+            throw error;
+        }
+    }
+};
+
+// Sizes socket buffers after the bandwidth-delay product of connections
+//
+// Every time a connection is tuned, its round trip time and delivery rate are
+// read from the kernel and its buffers resized to twice the amount of data in
+// flight, within per connection bounds and a memory budget shared by all the
+// connections using the tuner. The tuner must outlive those connections
+class TcpBufferTuner {
+    std::mutex lock;
+
+    size_t min_size;
+    size_t max_size;
+    size_t budget;
+
+    // Buffer size currently granted to every tuned connection
+    std::unordered_map<int, size_t> sizes;
+    size_t allocated;
+
+  public:
+    TcpBufferTuner(size_t budget, size_t min_size, size_t max_size) {
+        this->min_size = min_size;
+        this->max_size = std::max(min_size, max_size);
+        this->budget = budget;
+        this->allocated = 0;
+    }
+    TcpBufferTuner(size_t budget) : TcpBufferTuner(budget, 1 << 14, 1 << 24) {}
+
+    // Memory granted to all the tuned connections
+    size_t used() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->allocated;
+    }
+
+    // Resize the buffers of a connection, returns their new size
+    size_t tune(int fd) {
+        auto info = TcpSocketOptions::info(fd);
+
+        // Bytes in flight over one round trip, estimated from the congestion
+        // window until the kernel measured a delivery rate
+        double bdp = (double)info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+        if (info.tcpi_delivery_rate > 0 && info.tcpi_rtt > 0) {
+            bdp = (double)info.tcpi_delivery_rate * info.tcpi_rtt / 1e6;
+        }
+        size_t target = std::min((double)this->max_size,
+                                 std::max((double)this->min_size, 2 * bdp));
+
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            auto& size = this->sizes[fd];
+            auto available = this->budget - std::min(this->budget,
+                                                     this->allocated - size);
+            target = std::max(this->min_size, std::min(target, available));
+            this->allocated += target - size;
+            size = target;
+        }
+
+        TcpSocketOptions::set_buffer_size(fd, target);
+        return target;
+    }
+
+    // Give back the memory granted to a connection about to be closed
+    void release(int fd) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto it = this->sizes.find(fd);
+        if (it != this->sizes.end()) {
+            this->allocated -= it->second;
+            this->sizes.erase(it);
+        }
+    }
+};
+
+// Token bucket limiting the rate at which bytes are sent
+//
+// Sending more than the bucket holds puts it in debt, which the next send
+// has to wait out, so chunks larger than the burst size are still paced
+class TcpTokenBucket {
+    std::mutex lock;
+
+    // Bytes per second and maximum number of tokens
+    double rate;
+    double burst;
+
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+
+  public:
+    TcpTokenBucket(double rate, double burst) {
+        this->rate = rate;
+        this->burst = burst;
+        this->tokens = burst;
+        this->last = std::chrono::steady_clock::now();
+    }
+
+    // Take "count" tokens, waiting for the bucket to refill if it is in debt
+    void acquire(size_t count) {
+        std::chrono::duration<double> wait(0);
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> elapsed = now - this->last;
+            this->last = now;
+            this->tokens = std::min(
+                this->burst, this->tokens + elapsed.count() * this->rate);
+
+            if (this->tokens < 0) {
+                wait =
+                    std::chrono::duration<double>(-this->tokens / this->rate);
+            }
+            this->tokens -= count;
+        }
+
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+};
+
+// Log of the messages flowing through sockets and servers, for replaying
+// real traffic later on
+//
+// Records are appended to a memory mapped file grown a segment at a time, each
+// made of its direction, the time elapsed since the previous record, the
+// connection it belongs to and the message size as variable length integers,
+// then the message itself. A zero byte where a record would start ends the
+// log, which is what the unused tail of the file is filled with if the process
+// dies before the capture is closed
+class TcpCapture {
+  public:
+    enum Direction : uint8_t {
+        received = 1,
+        sent = 2,
+    };
+
+    // Identifies capture files, the last byte being the format version
+    static constexpr char magic[8] = {'N', 'I', 'X', 'T', 'C', 'A', 'P', 1};
+
+  private:
+    // Amount the file is grown by whenever it fills up
+    static constexpr size_t segment = 16 << 20;
+
+    int fd;
+    uint8_t* map;
+    size_t mapped;
+    size_t offset;
+
+    std::chrono::steady_clock::time_point start;
+    int64_t last_time;
+    std::atomic<uint64_t> next_connection;
+    std::mutex lock;
+
+    // Make room for "len" more bytes
+    void reserve(size_t len) {
+        if (this->offset + len <= this->mapped) {
+            return;
+        }
+
+        auto size = this->mapped + std::max(segment, len);
+        if (ftruncate(this->fd, size) == -1) {
+            struct TcpError error = {errno, "couldn't grow capture"};
+            throw error;
+        }
+        auto map = this->map == nullptr
+                       ? mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, this->fd, 0)
+                       : mremap(this->map, this->mapped, size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            struct TcpError error = {errno, "couldn't map capture"};
+            throw error;
+        }
+        this->map = (uint8_t*)map;
+        this->mapped = size;
+    }
+
+    static size_t put_varint(uint8_t* out, uint64_t value) {
+        size_t len = 0;
+        while (value >= 0x80) {
+            out[len++] = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        out[len++] = (uint8_t)value;
+        return len;
+    }
+
+  public:
+    // Create or truncate the capture file at "path"
+    TcpCapture(std::string const& path) {
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+        if (this->fd == -1) {
+            struct TcpError error = {errno, "couldn't create capture"};
+            throw error;
+        }
+        this->map = nullptr;
+        this->mapped = 0;
+        this->offset = 0;
+        this->start = std::chrono::steady_clock::now();
+        this->last_time = 0;
+        this->next_connection = 1;
+
+        try {
+            this->reserve(sizeof magic);
+        } catch (TcpError&) {
+            ::close(this->fd);
+            throw;
+        }
+        std::memcpy(this->map, magic, sizeof magic);
+        this->offset = sizeof magic;
+    }
+    TcpCapture(TcpCapture const&) = delete;
+    TcpCapture& operator=(TcpCapture const&) = delete;
+
+    // Trim the file to the records written
+    ~TcpCapture() {
+        munmap(this->map, this->mapped);
+        // Should this fail, the zeroed tail still ends the log
+        auto trimmed = ftruncate(this->fd, this->offset);
+        (void)trimmed;
+        ::close(this->fd);
+    }
+
+    // New connection identifier, unique within the capture
+    uint64_t connection() { return this->next_connection++; }
+
+    // Append a message to the log
+    void record(uint64_t connection, Direction direction, uint8_t const* data,
+                size_t len) {
+        std::lock_guard<std::mutex> guard(this->lock);
+
+        // Times are taken under the lock so that records stay in order
+        auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - this->start)
+                        .count();
+        this->reserve(1 + 3 * 10 + len);
+
+        auto out = this->map + this->offset;
+        size_t header = 0;
+        out[header++] = direction;
+        header += put_varint(out + header, time - this->last_time);
+        header += put_varint(out + header, connection);
+        header += put_varint(out + header, len);
+        std::memcpy(out + header, data, len);
+
+        this->offset += header + len;
+        this->last_time = time;
+    }
+    void record(uint64_t connection, Direction direction,
+                std::vector<uint8_t> const& data) {
+        this->record(connection, direction, data.data(), data.size());
+    }
+
+    // Bytes written to the log so far
+    size_t size() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->offset;
+    }
+};
+
+// Reads back the records of a capture file, in the order they were written
+class TcpCaptureReader {
+  public:
+    struct Record {
+        // Time since the capture was opened
+        std::chrono::nanoseconds time;
+        uint64_t connection;
+        TcpCapture::Direction direction;
+        // Message, pointing into the mapped file
+        uint8_t const* data;
+        size_t size;
+    };
+
+  private:
+    int fd;
+    uint8_t const* map;
+    size_t mapped;
+    size_t offset;
+    int64_t time;
+
+    bool get_varint(uint64_t& value) {
+        value = 0;
+        for (auto shift = 0; shift < 64; shift += 7) {
+            if (this->offset >= this->mapped) {
+                return false;
+            }
+            auto byte = this->map[this->offset++];
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+  public:
+    TcpCaptureReader(std::string const& path) {
+        this->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (this->fd == -1) {
+            struct TcpError error = {errno, "couldn't open capture"};
+            throw error;
+        }
+
+        struct stat info;
+        if (fstat(this->fd, &info) == -1 ||
+            (size_t)info.st_size < sizeof TcpCapture::magic) {
+            struct TcpError error = {1, "not a capture"};
+            ::close(this->fd);
+            throw error;
+        }
+        this->mapped = info.st_size;
+        auto map = mmap(nullptr, this->mapped, PROT_READ, MAP_PRIVATE,
+                        this->fd, 0);
+        if (map == MAP_FAILED) {
+            struct TcpError error = {errno, "couldn't map capture"};
+            ::close(this->fd);
+            throw error;
+        }
+        this->map = (uint8_t const*)map;
+        if (std::memcmp(this->map, TcpCapture::magic,
+                        sizeof TcpCapture::magic) != 0) {
+            struct TcpError error = {1, "not a capture"};
+            munmap(map, this->mapped);
+            ::close(this->fd);
+            throw error;
+        }
+
+        this->offset = sizeof TcpCapture::magic;
+        this->time = 0;
+    }
+    TcpCaptureReader(TcpCaptureReader const&) = delete;
+    TcpCaptureReader& operator=(TcpCaptureReader const&) = delete;
+
+    ~TcpCaptureReader() {
+        munmap((void*)this->map, this->mapped);
+        ::close(this->fd);
+    }
+
+    // Next record, nothing once the end of the log is reached
+    //
+    // A record cut short by the end of the file, as left by a process killed
+    // while writing it, ends the log too
+    std::optional<Record> next() {
+        if (this->offset >= this->mapped || this->map[this->offset] == 0) {
+            return std::nullopt;
+        }
+
+        Record record;
+        record.direction = (TcpCapture::Direction)this->map[this->offset++];
+        uint64_t delta;
+        uint64_t size;
+        if (!this->get_varint(delta) || !this->get_varint(record.connection) ||
+            !this->get_varint(size) || size > this->mapped - this->offset) {
+            this->offset = this->mapped;
+            return std::nullopt;
+        }
+
+        this->time += delta;
+        record.time = std::chrono::nanoseconds(this->time);
+        record.data = this->map + this->offset;
+        record.size = size;
+        this->offset += size;
+        return record;
+    }
+};
+
+// Durable queue of outbound messages, kept in a directory of memory mapped
+// segment files
+//
+// Every segment starts with a header holding the offset of its first message
+// still to be delivered, followed by the messages as their size, a checksum
+// and their bytes. A crash loses at most what was appended since the last
+// sync, and may have messages delivered again if it happens before the
+// delivery of messages was synced
+//
+// Not thread safe, meant to be used by a single socket
+class TcpSpool {
+  public:
+    // Identifies segment files, the last byte being the format version
+    static constexpr char magic[8] = {'N', 'I', 'X', 'T', 'S', 'P', 'L', 2};
+
+    // Message at the front of the spool, valid until it is popped
+    struct Message {
+        uint8_t const* data;
+        size_t size;
+    };
+
+  private:
+    // Magic, then the offset of the first message left to deliver
+    static constexpr size_t header_len = 16;
+    // Size and checksum of a message
+    static constexpr size_t record_len = 8;
+
+    struct Segment {
+        uint64_t sequence;
+        int fd;
+        uint8_t* map;
+        // Offsets of the first message left to deliver and of the end of
+        // the messages
+        size_t head;
+        size_t tail;
+        // Offset up to which messages were synced, and whether the head was
+        // moved since the last sync
+        size_t synced;
+        bool head_dirty;
+    };
+
+    std::string directory;
+    size_t segment_size;
+    size_t max_segments;
+    // Bytes appended between two syncs
+    size_t sync_bytes;
+
+    std::deque<Segment> segments;
+    size_t messages;
+    size_t unsynced;
+
+    static uint32_t checksum(uint8_t const* data, size_t len) {
+        return TcpKernels::get().crc32c(data, len);
+    }
+
+    static size_t aligned(size_t len) { return (len + 7) & ~(size_t)7; }
+
+    std::string path(uint64_t sequence) {
+        char name[32];
+        std::snprintf(name, sizeof name, "%016llx.spool",
+                      (unsigned long long)sequence);
+        return this->directory + "/" + name;
+    }
+
+    // Size of the message at "offset" of a segment, if there is a whole one
+    size_t record_at(Segment const& segment, size_t offset) {
+        if (offset + record_len > this->segment_size) {
+            return 0;
+        }
+        uint32_t size;
+        uint32_t sum;
+        std::memcpy(&size, segment.map + offset, 4);
+        std::memcpy(&sum, segment.map + offset + 4, 4);
+        if (size == 0 || offset + record_len + size > this->segment_size ||
+            checksum(segment.map + offset + record_len, size) != sum) {
+            return 0;
+        }
+        return size;
+    }
+
+    void map(Segment& segment) {
+        auto map = mmap(nullptr, this->segment_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, segment.fd, 0);
+        if (map == MAP_FAILED) {
+            struct TcpError error = {errno, "couldn't map spool segment"};
+            ::close(segment.fd);
+            throw error;
+        }
+        segment.map = (uint8_t*)map;
+    }
+
+    // Create the next segment, durably
+    void create() {
+        Segment segment;
+        segment.sequence =
+            this->segments.empty() ? 0 : this->segments.back().sequence + 1;
+        segment.fd = open(this->path(segment.sequence).c_str(),
+                          O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (segment.fd == -1) {
+            struct TcpError error = {errno, "couldn't create spool segment"};
+            throw error;
+        }
+        if (ftruncate(segment.fd, this->segment_size) == -1) {
+            struct TcpError error = {errno, "couldn't size spool segment"};
+            ::close(segment.fd);
+            throw error;
+        }
+        this->map(segment);
+
+        segment.head = header_len;
+        segment.tail = header_len;
+        segment.synced = header_len;
+        segment.head_dirty = false;
+        std::memcpy(segment.map, magic, sizeof magic);
+        uint64_t head = header_len;
+        std::memcpy(segment.map + 8, &head, 8);
+        msync(segment.map, header_len, MS_SYNC);
+        this->sync_directory();
+
+        this->segments.push_back(segment);
+    }
+
+    // Open the segments left by a previous spool, dropping delivered ones
+    void recover() {
+        auto dir = opendir(this->directory.c_str());
+        if (dir == nullptr) {
+            struct TcpError error = {errno, "couldn't open spool directory"};
+            throw error;
+        }
+        std::vector<uint64_t> sequences;
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() == 22 && name.compare(16, 6, ".spool") == 0) {
+                sequences.push_back(std::strtoull(name.c_str(), nullptr, 16));
+            }
+        }
+        closedir(dir);
+        std::sort(sequences.begin(), sequences.end());
+
+        for (auto sequence : sequences) {
+            Segment segment;
+            segment.sequence = sequence;
+            segment.fd = open(this->path(sequence).c_str(),
+                              O_RDWR | O_CLOEXEC);
+            struct stat info;
+            if (segment.fd == -1 || fstat(segment.fd, &info) == -1 ||
+                (size_t)info.st_size != this->segment_size) {
+                struct TcpError error = {errno, "couldn't open spool segment"};
+                if (segment.fd != -1) {
+                    ::close(segment.fd);
+                }
+                throw error;
+            }
+            this->map(segment);
+            this->segments.push_back(segment);
+
+            uint64_t head;
+            std::memcpy(&head, segment.map + 8, 8);
+            if (std::memcmp(segment.map, magic, sizeof magic) != 0 ||
+                head < header_len || head > this->segment_size) {
+                struct TcpError error = {1, "invalid spool segment"};
+                throw error;
+            }
+
+            // Messages end with the first one that was never fully written
+            auto& back = this->segments.back();
+            back.head = head;
+            back.tail = head;
+            while (auto size = this->record_at(back, back.tail)) {
+                back.tail += aligned(record_len + size);
+                this->messages++;
+            }
+            back.synced = back.tail;
+            back.head_dirty = false;
+        }
+
+        // Delivered segments are of no use, except the last one which new
+        // messages go to
+        while (this->segments.size() > 1 &&
+               this->segments.front().head == this->segments.front().tail) {
+            this->remove();
+        }
+    }
+
+    // Delete the first segment
+    void remove() {
+        auto& segment = this->segments.front();
+        munmap(segment.map, this->segment_size);
+        ::close(segment.fd);
+        unlink(this->path(segment.sequence).c_str());
+        this->segments.pop_front();
+    }
+
+    // Have segments created and deleted survive a crash
+    void sync_directory() {
+        auto fd = open(this->directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+  public:
+    // Open the spool kept in "directory", creating it if needed
+    //
+    // It may use up to "max_segments" files of "segment_size" bytes, which
+    // must be the size it was created with, and messages appended are synced
+    // every "sync_bytes" bytes
+    TcpSpool(std::string const& directory, size_t segment_size,
+             size_t max_segments, size_t sync_bytes) {
+        this->directory = directory;
+        this->segment_size = aligned(std::max(segment_size, (size_t)4096));
+        this->max_segments = std::max(max_segments, (size_t)1);
+        this->sync_bytes = sync_bytes;
+        this->messages = 0;
+        this->unsynced = 0;
+
+        if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+            struct TcpError error = {errno, "couldn't create spool directory"};
+            throw error;
+        }
+        try {
+            this->recover();
+            if (this->segments.empty()) {
+                this->create();
+            }
+        } catch (TcpError&) {
+            for (auto& segment : this->segments) {
+                munmap(segment.map, this->segment_size);
+                ::close(segment.fd);
+            }
+            throw;
+        }
+    }
+    TcpSpool(std::string const& directory)
+        : TcpSpool(directory, 16 << 20, 64, 1 << 20) {}
+    TcpSpool(TcpSpool const&) = delete;
+    TcpSpool& operator=(TcpSpool const&) = delete;
+
+    // Sync what is left on drop
+    ~TcpSpool() {
+        this->sync();
+        for (auto& segment : this->segments) {
+            munmap(segment.map, this->segment_size);
+            ::close(segment.fd);
+        }
+    }
+
+    // Append a message, returns false if the spool is full
+    bool append(uint8_t const* data, size_t size) {
+        auto len = aligned(record_len + size);
+        if (size == 0 || size > UINT32_MAX ||
+            header_len + len > this->segment_size) {
+            struct TcpError error = {EMSGSIZE, "message can't be spooled"};
+            throw error;
+        }
+
+        if (this->segments.back().tail + len > this->segment_size) {
+            // A delivered first segment can go once the next one exists
+            auto& front = this->segments.front();
+            auto delivered = front.head == front.tail;
+            if (this->segments.size() - delivered >= this->max_segments) {
+                return false;
+            }
+            this->create();
+            if (delivered) {
+                this->remove();
+                this->sync_directory();
+            }
+        }
+
+        // The checksum tells a message that was fully written from one that
+        // wasn't
+        auto& segment = this->segments.back();
+        auto out = segment.map + segment.tail;
+        uint32_t size32 = size;
+        uint32_t sum = checksum(data, size);
+        std::memcpy(out, &size32, 4);
+        std::memcpy(out + 4, &sum, 4);
+        std::memcpy(out + record_len, data, size);
+        segment.tail += len;
+        this->messages++;
+
+        this->unsynced += len;
+        if (this->unsynced >= this->sync_bytes) {
+            this->sync();
+        }
+        return true;
+    }
+    bool append(std::vector<uint8_t> const& data) {
+        return this->append(data.data(), data.size());
+    }
+
+    // Oldest message left to deliver, if any
+    std::optional<Message> front() {
+        auto& segment = this->segments.front();
+        if (segment.head == segment.tail) {
+            return std::nullopt;
+        }
+        uint32_t size;
+        std::memcpy(&size, segment.map + segment.head, 4);
+        return Message{segment.map + segment.head + record_len, size};
+    }
+
+    // Mark the oldest message as delivered
+    void pop() {
+        auto& segment = this->segments.front();
+        if (segment.head == segment.tail) {
+            return;
+        }
+        uint32_t size;
+        std::memcpy(&size, segment.map + segment.head, 4);
+        segment.head += aligned(record_len + size);
+        uint64_t head = segment.head;
+        std::memcpy(segment.map + 8, &head, 8);
+        segment.head_dirty = true;
+        this->messages--;
+
+        if (segment.head == segment.tail && this->segments.size() > 1) {
+            this->remove();
+            this->sync_directory();
+        }
+    }
+
+    // Write what was appended and delivered so far to disk
+    void sync() {
+        auto page = (size_t)sysconf(_SC_PAGESIZE);
+        for (auto& segment : this->segments) {
+            if (segment.tail > segment.synced) {
+                auto start = segment.synced / page * page;
+                msync(segment.map + start, segment.tail - start, MS_SYNC);
+                segment.synced = segment.tail;
+            }
+            if (segment.head_dirty) {
+                msync(segment.map, header_len, MS_SYNC);
+                segment.head_dirty = false;
+            }
+        }
+        this->unsynced = 0;
+    }
+
+    // Number of messages left to deliver
+    size_t size() { return this->messages; }
+    bool empty() { return this->messages == 0; }
+
+    // Disk space taken by the spool
+    size_t disk_usage() { return this->segments.size() * this->segment_size; }
+};
+
+class TcpRelay;
+class TcpBalancer;
+class TcpMetricsExporter;
+class TcpServerGroup;
+
+// Wrapper around a *nix TCP socket
+class TcpSocket {
+    friend class TcpRelay;
+    friend class TcpBalancer;
+    friend class TcpMetricsExporter;
+
+    // Local socket file descriptor
+    std::optional<int> sockfd;
+    // Remote socket file descriptor
+    std::optional<int> remote_sockfd;
+
+    // Length of the packets sent, and of the packets received, which
+    // differ once either side adapts the length to its messages
+    uint8_t packet_len;
+    uint8_t recv_packet_len;
+    // Length the socket was created with, which every connection starts at
+    uint8_t initial_packet_len;
+
+    // Range the length of sent packets is adapted within, none if "max" is 0
+    uint8_t adaptive_min;
+    uint8_t adaptive_max;
+    // Sizes of the last messages sent, the length being reconsidered every
+    // time the ring was written over once
+    std::vector<size_t> recent_sizes;
+    size_t recent_count;
+    // Whether the size of messages sent is announced ahead of them
+    bool announcing;
+    // Largest message received
+    size_t max_message;
+    // Whether messages of a higher priority are written in the middle of
+    // the one being written
+    bool preempting;
+    // Beginning of the message an urgent one interrupted, which the next
+    // receive resumes
+    std::optional<std::vector<uint8_t>> interrupted;
+
+    // Message waiting to be sent
+    struct Outbound {
+        uint8_t const* data;
+        size_t size;
+        uint8_t priority;
+        uint64_t sequence;
+
+        bool done;
+        std::optional<TcpError> error;
+    };
+    // Orders outbound messages by priority, then in the order they were sent
+    struct OutboundOrder {
+        bool operator()(Outbound const* a, Outbound const* b) const {
+            return a->priority != b->priority ? a->priority < b->priority
+                                              : a->sequence > b->sequence;
+        }
+    };
+
+    // Messages waiting for the current writer to send them
+    std::priority_queue<Outbound*, std::vector<Outbound*>, OutboundOrder>
+        outbound;
+    uint64_t outbound_sequence;
+    // Largest number of messages queued so far
+    size_t outbound_high;
+    // Whether a thread is currently writing messages to the socket
+    bool writing;
+    std::mutex outbound_lock;
+    std::condition_variable outbound_done;
+
+    // Maximum number of bytes of packets written to the socket at once
+    size_t send_chunk;
+    // Rate limits of each priority level
+    std::unordered_map<uint8_t, std::shared_ptr<TcpTokenBucket>> rate_limits;
+    // Tuner sizing the buffers of the connection, if any
+    TcpBufferTuner* tuner;
+
+    // Whether the kernel timestamps the data of the connection
+    bool timestamping;
+    // Bytes written since timestamping was enabled, which is what the kernel
+    // identifies transmit timestamps with
+    uint32_t tx_bytes;
+    // Messages waiting for their transmit timestamps, as the identifier of
+    // their last byte and the time they were written
+    std::deque<std::pair<uint32_t, int64_t>> tx_pending;
+    std::mutex tx_pending_lock;
+    // Kernel receive timestamp of the last message received
+    std::optional<std::chrono::nanoseconds> rx_timestamp;
+
+    // Capture the messages are recorded to, if any, and the identifier of
+    // the connection in it
+    TcpCapture* capture;
+    uint64_t capture_id;
+
+    // Spool messages are kept in while they can't be sent, if any
+    TcpSpool* spool;
+    // Held while sending with a spool, so that messages keep their order
+    std::mutex spool_lock;
+
+    static void* get_in_addr(struct sockaddr* sa) {
+        return sa->sa_family == AF_INET
+                   ? (void*)&(((struct sockaddr_in*)sa)->sin_addr)
+                   : (void*)&(((struct sockaddr_in6*)sa)->sin6_addr);
+    }
+
+    // Write a whole buffer to the remote socket
+    void write_all(uint8_t const* buffer, size_t len) {
+        while (len > 0) {
+            auto sent = ::send(*this->remote_sockfd, buffer, len, MSG_NOSIGNAL);
+            TcpMetrics::add(TcpMetrics::syscalls);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                struct TcpError error = {errno, "couldn't send data"};
+                throw error;
+            }
+
+            TcpMetrics::add(TcpMetrics::bytes_sent, sent);
+            this->tx_bytes += sent;
+            buffer += sent;
+            len -= sent;
+        }
+    }
+
+    // Bytes of packets an announced message is first received into, the
+    // buffer doubling from there as they come in
+    static constexpr size_t recv_step = 1 << 20;
+
+    // Bytes a packet is deemed to cost on top of its length, as the receiver
+    // reads messages packet by packet
+    static constexpr size_t packet_cost = 64;
+
+    // Packet length best suited to the recent messages, which is the current
+    // one unless another one is at least 10% cheaper
+    //
+    // A length that can't terminate some of the recent messages (their size
+    // being a multiple of its chunk length) is never switched to
+    uint8_t best_packet_len() {
+        auto cost = [&](uint8_t packet_len) {
+            auto announce = this->announces(packet_len);
+            size_t total = 0;
+            for (auto size : this->recent_sizes) {
+                if (packet_len != this->packet_len && !announce && size > 0 &&
+                    size % (packet_len - 1) == 0) {
+                    return SIZE_MAX;
+                }
+                total += (TcpPacketEncoder::packets(packet_len, size) +
+                          announce) *
+                         (packet_len + packet_cost);
+            }
+            return total;
+        };
+
+        auto best = this->packet_len;
+        auto best_cost = cost(best) / 10 * 9;
+        for (unsigned len = this->adaptive_min; len <= this->adaptive_max;
+             len++) {
+            auto len_cost = cost(len);
+            if (len_cost < best_cost) {
+                best = len;
+                best_cost = len_cost;
+            }
+        }
+        return best;
+    }
+
+    // Wait for no other thread to be writing, then become the writer, for
+    // writes not going through the outbound queue
+    void acquire_writer() {
+        std::unique_lock<std::mutex> guard(this->outbound_lock);
+        this->outbound_done.wait(guard, [this] { return !this->writing; });
+        this->writing = true;
+    }
+
+    // Stop being the writer, letting a thread with a queued message take over
+    void release_writer() {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->writing = false;
+        this->outbound_done.notify_all();
+    }
+
+    // Switch the length of sent packets, the receiver learning about it from
+    // a packet of the old length
+    void resize_packets(uint8_t packet_len) {
+        std::vector<uint8_t> packet(this->packet_len);
+        TcpPacketEncoder::encode_resize(this->packet_len, packet_len,
+                                        packet.data());
+        this->write_all(packet.data(), packet.size());
+
+        NIX_TCP_PROBE(resize, *this->remote_sockfd, this->packet_len,
+                      packet_len);
+        this->packet_len = packet_len;
+    }
+
+    // Track the size of a message about to be written, and switch to a
+    // better packet length first if it is time to reconsider it
+    void adapt_packet_len(size_t size) {
+        if (this->adaptive_max == 0) {
+            return;
+        }
+
+        this->recent_sizes[this->recent_count++ % this->recent_sizes.size()] =
+            size;
+        if (this->recent_count % this->recent_sizes.size() == 0) {
+            auto best = this->best_packet_len();
+            if (best != this->packet_len) {
+                this->resize_packets(best);
+            }
+        }
+
+        // A message filling its last packet would never end, so unless it is
+        // announced it is sent with the closest length that leaves it a short
+        // one
+        if (!this->announces(this->packet_len) && size > 0 &&
+            size % (this->packet_len - 1) == 0) {
+            for (unsigned delta = 1; delta < 256; delta++) {
+                auto len = this->packet_len + delta;
+                if (len > this->adaptive_max || size % (len - 1) == 0) {
+                    len = this->packet_len - delta;
+                }
+                if (len >= this->adaptive_min && len <= this->adaptive_max &&
+                    size % (len - 1) != 0) {
+                    this->resize_packets(len);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Whether messages sent in packets of "packet_len" bytes are announced
+    bool announces(uint8_t packet_len) {
+        return this->announcing &&
+               packet_len >= TcpPacketEncoder::min_announce_len;
+    }
+
+    // Split a message into packets and write them, batching as many packets
+    // as fit in a chunk per system call
+    //
+    // Between two chunks, messages queued with a higher priority than
+    // "priority" are written in the middle of it if preempting is enabled.
+    // Only plain messages can be interrupted, since the packets of announced
+    // ones are received at once
+    void write_message(uint8_t const* data, size_t size, uint8_t priority,
+                       TcpTokenBucket* rate_limit) {
+        this->adapt_packet_len(size);
+
+        auto announce = this->announces(this->packet_len);
+        auto preempt = this->preempting && !announce &&
+                       this->packet_len >= TcpPacketEncoder::min_announce_len;
+        uint8_t header = announce ? TcpPacketEncoder::announce : 0;
+        this->write_packets(data, size, header, rate_limit,
+                            preempt ? std::optional<uint8_t>(priority)
+                                    : std::nullopt);
+    }
+
+    // Write the messages queued with a priority above "priority" as urgent
+    // ones, in the middle of the message being written
+    void write_urgent(uint8_t priority) {
+        while (true) {
+            Outbound* next;
+            std::shared_ptr<TcpTokenBucket> rate_limit;
+            {
+                std::lock_guard<std::mutex> guard(this->outbound_lock);
+                if (this->outbound.empty() ||
+                    this->outbound.top()->priority <= priority) {
+                    return;
+                }
+                next = this->outbound.top();
+                this->outbound.pop();
+                TcpMetrics::adjust(TcpMetrics::queued_messages, -1);
+
+                auto limit = this->rate_limits.find(next->priority);
+                if (limit != this->rate_limits.end()) {
+                    rate_limit = limit->second;
+                }
+            }
+
+            NIX_TCP_PROBE(preempt, *this->remote_sockfd, next->size,
+                          next->priority);
+            std::optional<TcpError> error;
+            try {
+                this->write_packets(next->data, next->size,
+                                    TcpPacketEncoder::urgent, rate_limit.get(),
+                                    std::nullopt);
+            } catch (TcpError& e) {
+                error = e;
+            }
+
+            std::lock_guard<std::mutex> guard(this->outbound_lock);
+            next->error = error;
+            next->done = true;
+            this->outbound_done.notify_all();
+            // The interrupted message can't be finished either
+            if (error.has_value()) {
+                throw *error;
+            }
+        }
+    }
+
+    // Write the packets of a message, behind a control packet of kind
+    // "header" carrying its size unless "header" is 0, letting urgent
+    // messages above "preempt" in between chunks if set
+    void write_packets(uint8_t const* data, size_t size, uint8_t header,
+                       TcpTokenBucket* rate_limit,
+                       std::optional<uint8_t> preempt) {
+        auto announce = header != 0;
+        size_t per_chunk =
+            std::max((size_t)1, this->send_chunk / this->packet_len);
+        size_t packets =
+            TcpPacketEncoder::packets(this->packet_len, size) + announce;
+
+        std::vector<uint8_t> chunk(std::min(packets, per_chunk) *
+                                   this->packet_len);
+
+        auto written = realtime();
+
+        // The announcement goes at the beginning of the first chunk
+        size_t len = 0;
+        if (announce) {
+            TcpPacketEncoder::encode_announce(this->packet_len, size,
+                                              chunk.data());
+            chunk[1] = header;
+            len = this->packet_len;
+        }
+
+        // Loop through the data by chunks
+        size_t offset = 0;
+        while (offset < size || len > 0) {
+            len += TcpPacketEncoder::encode(
+                this->packet_len, data, size, offset,
+                per_chunk - len / this->packet_len, chunk.data() + len);
+            if (rate_limit != nullptr) {
+                rate_limit->acquire(len);
+            }
+            this->write_all(chunk.data(), len);
+            len = 0;
+
+            if (preempt.has_value() && offset < size) {
+                this->write_urgent(*preempt);
+            }
+        }
+
+        // Only the timestamps of the last byte of the message matter
+        if (this->timestamping && size > 0) {
+            std::lock_guard<std::mutex> guard(this->tx_pending_lock);
+            this->tx_pending.emplace_back(this->tx_bytes - 1, written);
+            // Don't hoard messages whose timestamps got lost
+            if (this->tx_pending.size() > 4096) {
+                this->tx_pending.pop_front();
+            }
+        }
+    }
+
+    static int64_t realtime() {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    }
+
+    // Kernel timestamp carried by a control message, preferring the hardware
+    // one when there is one
+    static std::optional<int64_t> timestamp_of(struct msghdr* message) {
+        for (auto cmsg = CMSG_FIRSTHDR(message); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(message, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_TIMESTAMPING) {
+                continue;
+            }
+
+            struct scm_timestamping stamps;
+            std::memcpy(&stamps, CMSG_DATA(cmsg), sizeof stamps);
+            auto& stamp = stamps.ts[2].tv_sec != 0 || stamps.ts[2].tv_nsec != 0
+                              ? stamps.ts[2]
+                              : stamps.ts[0];
+            return (int64_t)stamp.tv_sec * 1000000000 + stamp.tv_nsec;
+        }
+        return std::nullopt;
+    }
+
+    // Receive the first packet of a message along with its kernel timestamp
+    ssize_t recv_timestamped(uint8_t* packet) {
+        struct iovec iov = {packet, this->recv_packet_len};
+        char control[256];
+        struct msghdr message;
+        std::memset(&message, 0, sizeof message);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof control;
+
+        auto received = recvmsg(*this->remote_sockfd, &message, MSG_WAITALL);
+        if (received <= 0) {
+            return received;
+        }
+
+        auto stamp = timestamp_of(&message);
+        if (stamp.has_value()) {
+            this->rx_timestamp = std::chrono::nanoseconds(*stamp);
+            NIX_TCP_PROBE(rx__timestamp, *this->remote_sockfd, *stamp);
+            TcpMetrics::observe(TcpMetrics::rx_kernel_latency,
+                                std::chrono::nanoseconds(realtime() - *stamp));
+        }
+        return received;
+    }
+
+    // Receive the packets of an announced message of "size" bytes, all at
+    // once unless it is large, and strip their chunk lengths in place
+    //
+    // The buffer only grows as packets actually come in, so a peer can't get
+    // memory allocated just by announcing a large message
+    template <typename Message>
+    void recv_announced(size_t size, Message& data) {
+        size_t packet_len = this->recv_packet_len;
+        auto packets = TcpPacketEncoder::packets(packet_len, size);
+        auto total = packets * packet_len;
+
+        size_t offset = 0;
+        while (offset < total) {
+            auto step = std::max(offset, recv_step / packet_len * packet_len);
+            data.resize(std::min(total, offset + step));
+
+            ssize_t received;
+            do {
+                received = ::recv(*this->remote_sockfd, data.data() + offset,
+                                  data.size() - offset, MSG_WAITALL);
+                TcpMetrics::add(TcpMetrics::syscalls);
+            } while (received == -1 && errno == EINTR);
+            if (received == -1) {
+                struct TcpError error = {errno, "couldn't receive data"};
+                throw error;
+            } else if ((size_t)received != data.size() - offset) {
+                struct TcpError error = {1, "invalid received packet length"};
+                throw error;
+            }
+            TcpMetrics::add(TcpMetrics::bytes_received, received);
+            offset = data.size();
+        }
+        if (total == 0) {
+            return;
+        }
+
+        if (!TcpKernels::get().strip(packet_len, data.data(), packets, size)) {
+            struct TcpError error = {1, "invalid announced message"};
+            throw error;
+        }
+        data.resize(size);
+    }
+
+    // Receive a message into "data", which is empty
+    template <typename Message>
+    void recv_message(Message& data) {
+        if (!this->is_bound()) {
+            struct TcpError error = {-2, "socket unbound"};
+            throw error;
+        }
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        NIX_TCP_PROBE(recv__start, *this->remote_sockfd);
+
+        // Resume the message an urgent one interrupted, if any
+        if (this->interrupted.has_value()) {
+            data.assign(this->interrupted->begin(), this->interrupted->end());
+            this->interrupted = std::nullopt;
+        }
+
+        Message packet(this->recv_packet_len, 0, data.get_allocator());
+
+        auto received = 0;
+        uint8_t count;
+        auto i = 0;
+        auto start = std::chrono::steady_clock::now();
+        while (true) {
+            // Receive a packet, which may have been split across segments
+            // along the way (by a relay for instance)
+            if (this->timestamping && data.empty()) {
+                received = this->recv_timestamped(packet.data());
+            } else {
+                received = ::recv(*this->remote_sockfd, packet.data(),
+                                  this->recv_packet_len, MSG_WAITALL);
+            }
+            TcpMetrics::add(TcpMetrics::syscalls);
+            if (received == -1) {
+                struct TcpError error = {errno, "couldn't send data"};
+                throw error;
+            } else if (received != this->recv_packet_len) {
+                struct TcpError error = {1, "invalid received packet length"};
+                throw error;
+            }
+
+            if (data.empty()) {
+                start = std::chrono::steady_clock::now();
+            }
+            TcpMetrics::add(TcpMetrics::bytes_received, received);
+
+            // Extract the chunk length
+            count = packet[0];
+            if (count == TcpPacketEncoder::control &&
+                packet[1] == TcpPacketEncoder::urgent) {
+                // Set the message aside while the urgent one is received
+                if (!data.empty()) {
+                    this->interrupted.emplace(data.begin(), data.end());
+                    data.clear();
+                }
+                this->recv_announced(
+                    TcpPacketDecoder::announced_size(this->recv_packet_len,
+                                                     packet.data(),
+                                                     this->max_message),
+                    data);
+                break;
+            } else if (count == TcpPacketEncoder::control && data.empty()) {
+                if (packet[1] == TcpPacketEncoder::announce) {
+                    this->recv_announced(
+                        TcpPacketDecoder::announced_size(this->recv_packet_len,
+                                                         packet.data(),
+                                                         this->max_message),
+                        data);
+                    break;
+                }
+                TcpPacketDecoder::apply(this->recv_packet_len, packet.data());
+                packet.resize(this->recv_packet_len);
+                continue;
+            } else if (count > this->recv_packet_len - 1) {
+                struct TcpError error = {1, "invalid received chunk length"};
+                throw error;
+            } else if (data.size() + count > this->max_message) {
+                struct TcpError error = {EMSGSIZE, "message too large"};
+                throw error;
+            }
+            // Append the chunk to the data
+            for (i = 1; i <= count; i++) {
+                data.push_back(packet[i]);
+            }
+
+            // If the chunk length is smaller than the max length it was the
+            // last packet
+            if (count < this->recv_packet_len - 1) {
+                break;
+            }
+        }
+
+        NIX_TCP_PROBE(recv__done, *this->remote_sockfd, data.size());
+        if (this->capture != nullptr) {
+            this->capture->record(this->capture_id, TcpCapture::received,
+                                  data.data(), data.size());
+        }
+        TcpMetrics::add(TcpMetrics::messages_received);
+        TcpMetrics::observe(TcpMetrics::recv_latency,
+                            std::chrono::steady_clock::now() - start);
+    }
+
+    // Queue a message and wait for it to be written
+    void send_message(uint8_t const* data, size_t size, uint8_t priority) {
+        if (!this->is_bound()) {
+            struct TcpError error = {-2, "socket unbound"};
+            throw error;
+        }
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        NIX_TCP_PROBE(send__start, *this->remote_sockfd, size, priority);
+        if (this->capture != nullptr) {
+            this->capture->record(this->capture_id, TcpCapture::sent, data,
+                                  size);
+        }
+        if (this->timestamping) {
+            this->poll_timestamps();
+        }
+
+        Outbound message = {data, size, priority, 0, false, std::nullopt};
+        auto start = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> guard(this->outbound_lock);
+        message.sequence = this->outbound_sequence++;
+        this->outbound.push(&message);
+        TcpMetrics::adjust(TcpMetrics::queued_messages, 1);
+        if (this->outbound.size() > this->outbound_high) {
+            this->outbound_high = this->outbound.size();
+            NIX_TCP_PROBE(queue__high, *this->remote_sockfd,
+                          this->outbound_high);
+        }
+
+        while (!message.done) {
+            // Another thread is writing and will get to this message
+            if (this->writing) {
+                this->outbound_done.wait(guard);
+                continue;
+            }
+
+            // Write queued messages until there are none left
+            this->writing = true;
+            while (!this->outbound.empty()) {
+                auto next = this->outbound.top();
+                this->outbound.pop();
+                TcpMetrics::adjust(TcpMetrics::queued_messages, -1);
+
+                std::shared_ptr<TcpTokenBucket> rate_limit;
+                auto limit = this->rate_limits.find(next->priority);
+                if (limit != this->rate_limits.end()) {
+                    rate_limit = limit->second;
+                }
+
+                guard.unlock();
+                try {
+                    this->write_message(next->data, next->size,
+                                        next->priority, rate_limit.get());
+                } catch (TcpError& error) {
+                    next->error = error;
+                }
+                guard.lock();
+
+                next->done = true;
+                this->outbound_done.notify_all();
+            }
+            this->writing = false;
+        }
+
+        if (message.error.has_value()) {
+            throw *message.error;
+        }
+
+        NIX_TCP_PROBE(send__done, *this->remote_sockfd, size);
+        TcpMetrics::add(TcpMetrics::messages_sent);
+        TcpMetrics::observe(TcpMetrics::send_latency,
+                            std::chrono::steady_clock::now() - start);
+    }
+
+    // Send a message, or spool it if it can't be sent right now
+    void send_spooled(uint8_t const* data, size_t size, uint8_t priority) {
+        std::lock_guard<std::mutex> guard(this->spool_lock);
+        if (this->is_connected() && this->spool->empty()) {
+            try {
+                this->send_message(data, size, priority);
+                return;
+            } catch (TcpError&) {
+                this->disconnect();
+            }
+        }
+
+        if (!this->spool->append(data, size)) {
+            struct TcpError error = {ENOSPC, "spool full"};
+            throw error;
+        }
+        if (this->is_connected()) {
+            try {
+                this->drain_spool();
+            } catch (TcpError&) {
+                // The message is safe in the spool
+            }
+        }
+    }
+
+    // Start a new connection from the packet length the socket was created
+    // with, since the peer knows nothing of the previous connection, then
+    // deliver the messages spooled while disconnected, if any
+    void connected() {
+        {
+            std::lock_guard<std::mutex> guard(this->outbound_lock);
+            this->packet_len = this->initial_packet_len;
+            this->recv_packet_len = this->initial_packet_len;
+            std::fill(this->recent_sizes.begin(), this->recent_sizes.end(), 0);
+            this->recent_count = 0;
+
+            // Timestamping was enabled on the previous socket only
+            this->timestamping = false;
+            this->tx_bytes = 0;
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->tx_pending_lock);
+            this->tx_pending.clear();
+        }
+        this->rx_timestamp = std::nullopt;
+        // Nor does it know anything of a message the previous one left
+        // halfway
+        this->interrupted = std::nullopt;
+
+        std::lock_guard<std::mutex> guard(this->spool_lock);
+        if (this->spool != nullptr) {
+            this->drain_spool();
+        }
+    }
+
+    // Deliver the spooled messages, disconnecting if one can't be written
+    void drain_spool() {
+        while (auto message = this->spool->front()) {
+            try {
+                this->send_message(message->data, message->size, 0);
+            } catch (TcpError&) {
+                this->disconnect();
+                throw;
+            }
+            this->spool->pop();
+        }
+    }
+
+  public:
+    TcpSocket(uint8_t packet_len) {
+        this->sockfd = std::nullopt;
+        this->remote_sockfd = std::nullopt;
+
+        this->packet_len = packet_len;
+        this->recv_packet_len = packet_len;
+        this->initial_packet_len = packet_len;
+
+        this->adaptive_min = 0;
+        this->adaptive_max = 0;
+        this->recent_count = 0;
+        this->announcing = false;
+        this->max_message = TcpPacketDecoder::default_max_message;
+        this->preempting = false;
+
+        this->outbound_sequence = 0;
+        this->outbound_high = 0;
+        this->writing = false;
+        this->send_chunk = 1 << 16;
+        this->tuner = nullptr;
+
+        this->timestamping = false;
+        this->tx_bytes = 0;
+
+        this->capture = nullptr;
+        this->capture_id = 0;
+
+        this->spool = nullptr;
+    }
+    TcpSocket() : TcpSocket(64) {}
+    TcpSocket(TcpSocket const&) = delete;
+    TcpSocket& operator=(TcpSocket const&) = delete;
+
+    // Close the sockets on drop
+    ~TcpSocket() {
+        if (this->is_connected()) {
+            this->disconnect();
+        }
+        if (this->is_bound()) {
+            close(*this->sockfd);
+        }
+    }
+
+    // Whether the socket is currently bound to a port
+    bool is_bound() { return this->sockfd.has_value(); }
+    // Whether the socket is currently connected to a remote socket
+    bool is_connected() { return this->remote_sockfd.has_value(); }
+
+    // Close the connection, after which another one can be accepted or made
+    void disconnect() {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        if (this->tuner != nullptr) {
+            this->tuner->release(*this->remote_sockfd);
+            this->tuner = nullptr;
+        }
+        close(*this->remote_sockfd);
+        this->remote_sockfd = std::nullopt;
+
+        TcpMetrics::add(TcpMetrics::connections_closed);
+    }
+
+    // Cap the rate at which the kernel sends data, in bytes per second
+    void set_pacing_rate(uint64_t rate) {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+        TcpSocketOptions::set_pacing_rate(*this->remote_sockfd, rate);
+    }
+
+    // Select the congestion control algorithm ("cubic", "bbr", ...)
+    void set_congestion_control(std::string const& name) {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+        TcpSocketOptions::set_congestion_control(*this->remote_sockfd, name);
+    }
+
+    // Limit the rate at which messages of a priority level are sent, in
+    // bytes per second with bursts of up to "burst" bytes
+    void set_rate_limit(uint8_t priority, double rate, double burst) {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->rate_limits[priority] =
+            std::make_shared<TcpTokenBucket>(rate, burst);
+    }
+
+    // Remove the rate limit of a priority level
+    void clear_rate_limit(uint8_t priority) {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->rate_limits.erase(priority);
+    }
+
+    // Adapt the length of the packets sent to the sizes of the messages,
+    // within "min" and "max"
+    //
+    // The length is reconsidered every 64 messages, and a change is announced
+    // to the receiver by a control packet. Sockets and servers of this library
+    // follow it, but peers speaking only the plain packet format don't, which
+    // is why the feature is opt-in. Messages whose size is a multiple of the
+    // chunk length, which the plain format can't end, also get a length of
+    // their own
+    void set_adaptive_packet_len(uint8_t min, uint8_t max) {
+        min = std::max(min, TcpPacketEncoder::min_packet_len);
+        if (max < min) {
+            struct TcpError error = {1, "invalid packet length range"};
+            throw error;
+        }
+
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->adaptive_min = min;
+        this->adaptive_max = max;
+        this->recent_sizes.assign(64, 0);
+        this->recent_count = 0;
+    }
+
+    // Keep sending packets of the current length
+    void clear_adaptive_packet_len() {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->adaptive_max = 0;
+    }
+
+    // Announce the size of every message sent ahead of its packets
+    //
+    // The receiver then reads the packets of messages up to 1 MiB in a
+    // single call, and messages filling their last packet end properly.
+    // Packets keep their usual layout, but the announcement is a control
+    // packet peers speaking only the plain format reject. Messages are sent
+    // in the plain format while packets are shorter than 11 bytes, too short
+    // to announce them
+    void set_length_announcing(bool announcing) {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->announcing = announcing;
+    }
+
+    // Write messages in the middle of a lower priority one already being
+    // written, between two of its 64 KiB chunks, instead of after it
+    //
+    // The urgent message goes behind a control packet carrying its size,
+    // which sockets, servers and relays of this library understand but peers
+    // speaking only the plain packet format reject, which is why the feature
+    // is opt-in. Messages sent announced and messages sent in packets shorter
+    // than 11 bytes are never interrupted
+    void set_preempting(bool preempting) {
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->preempting = preempting;
+    }
+
+    // Refuse messages larger than "bytes", announced or not, received messages
+    // being limited to 1 GiB by default
+    void set_max_message(size_t bytes) { this->max_message = bytes; }
+
+    // Resize the kernel buffers of the connection, and the chunks of packets
+    // written at once, after its bandwidth-delay product
+    //
+    // Meant to be called periodically, as the connection's conditions change
+    void autotune(TcpBufferTuner& tuner) {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        this->tuner = &tuner;
+        auto size = tuner.tune(*this->remote_sockfd);
+
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        this->send_chunk = std::min(std::max(size, (size_t)1 << 12),
+                                    (size_t)1 << 20);
+    }
+
+    // Have the kernel timestamp received messages, and messages sent as they
+    // leave the host and get acknowledged
+    //
+    // Software timestamps work everywhere, loopback included. Hardware ones
+    // are used when "hardware" is set and the network card was configured to
+    // produce them (SIOCSHWTSTAMP). Timestamps are reported through the
+    // metrics and the rx__timestamp and tx__timestamp probes
+    void enable_timestamping(bool hardware) {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        uint32_t flags = SOF_TIMESTAMPING_SOFTWARE |
+                         SOF_TIMESTAMPING_RX_SOFTWARE |
+                         SOF_TIMESTAMPING_TX_SOFTWARE |
+                         SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_OPT_ID |
+                         SOF_TIMESTAMPING_OPT_TSONLY;
+        if (hardware) {
+            flags |= SOF_TIMESTAMPING_RAW_HARDWARE |
+                     SOF_TIMESTAMPING_RX_HARDWARE |
+                     SOF_TIMESTAMPING_TX_HARDWARE;
+        }
+
+        // Identifiers restart from the next byte written
+        std::lock_guard<std::mutex> guard(this->outbound_lock);
+        if (setsockopt(*this->remote_sockfd, SOL_SOCKET, SO_TIMESTAMPING,
+                       &flags, sizeof flags) == -1) {
+            struct TcpError error = {errno, "couldn't enable timestamping"};
+            throw error;
+        }
+        this->timestamping = true;
+        this->tx_bytes = 0;
+    }
+    void enable_timestamping() { this->enable_timestamping(false); }
+
+    // Kernel receive timestamp of the last message received, if timestamping
+    // is enabled
+    std::optional<std::chrono::nanoseconds> last_rx_timestamp() {
+        return this->rx_timestamp;
+    }
+
+    // Read the transmit timestamps the kernel queued so far, which "send"
+    // also does every time
+    void poll_timestamps() {
+        if (!this->is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+
+        while (true) {
+            char control[512];
+            struct msghdr message;
+            std::memset(&message, 0, sizeof message);
+            message.msg_control = control;
+            message.msg_controllen = sizeof control;
+
+            if (recvmsg(*this->remote_sockfd, &message,
+                        MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+                return;
+            }
+
+            auto stamp = timestamp_of(&message);
+            struct sock_extended_err const* extended = nullptr;
+            for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+                 cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if ((cmsg->cmsg_level == SOL_IP &&
+                     cmsg->cmsg_type == IP_RECVERR) ||
+                    (cmsg->cmsg_level == SOL_IPV6 &&
+                     cmsg->cmsg_type == IPV6_RECVERR)) {
+                    extended = (struct sock_extended_err const*)CMSG_DATA(cmsg);
+                }
+            }
+            if (!stamp.has_value() || extended == nullptr ||
+                extended->ee_origin != SO_EE_ORIGIN_TIMESTAMPING) {
+                continue;
+            }
+
+            auto id = extended->ee_data;
+            auto kind = extended->ee_info;
+            NIX_TCP_PROBE(tx__timestamp, *this->remote_sockfd, kind, id,
+                          *stamp);
+
+            std::lock_guard<std::mutex> guard(this->tx_pending_lock);
+            for (auto it = this->tx_pending.begin();
+                 it != this->tx_pending.end(); it++) {
+                if (it->first != id) {
+                    continue;
+                }
+
+                auto latency = std::chrono::nanoseconds(*stamp - it->second);
+                if (kind == SCM_TSTAMP_SND) {
+                    TcpMetrics::observe(TcpMetrics::tx_wire_latency, latency);
+                } else if (kind == SCM_TSTAMP_ACK) {
+                    TcpMetrics::observe(TcpMetrics::tx_ack_latency, latency);
+                    // Acknowledgement is the last timestamp of a message
+                    this->tx_pending.erase(this->tx_pending.begin(), it + 1);
+                }
+                break;
+            }
+        }
+    }
+
+    // Record every message sent and received from now on to "capture",
+    // which must outlive the socket or "stop_recording" being called
+    //
+    // The socket gets a connection identifier of its own in the capture
+    void record(TcpCapture& capture) {
+        this->capture = &capture;
+        this->capture_id = capture.connection();
+    }
+    void stop_recording() { this->capture = nullptr; }
+
+    // Keep the messages that can't be sent in "spool", which must outlive
+    // the socket or "stop_spooling" being called, and deliver them once
+    // connected again
+    //
+    // Messages sent while disconnected, or while older ones wait in the
+    // spool, are appended to it rather than sent, "send" only failing if the
+    // spool is full. A message whose write fails disconnects the socket and
+    // is spooled, so the peer may get it twice, the first time cut short.
+    // Messages the kernel took before the peer went away are lost though,
+    // as nothing tells whether the peer got them. Messages left in the spool
+    // from a previous run are delivered too
+    void spool_to(TcpSpool& spool) {
+        std::lock_guard<std::mutex> guard(this->spool_lock);
+        this->spool = &spool;
+        if (this->is_connected()) {
+            this->drain_spool();
+        }
+    }
+    void stop_spooling() {
+        std::lock_guard<std::mutex> guard(this->spool_lock);
+        this->spool = nullptr;
+    }
+
+    // Binds the socket to the specified port
+    void bind(std::string const& port) {
+        if (this->is_bound()) {
+            struct TcpError error = {-1, "socket already bound"};
+            throw error;
+        }
+
+        // Basic information about the socket needed to find a suitable address
+        // to bind to
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof hints);
+        // IPV4 or IPV6 (read "AF_UNSPEC" as "address family : unspecified")
+        hints.ai_family = AF_UNSPEC;
+        // TCP (for UDP sockets this would be "SOCK_DATAGRAM")
+        hints.ai_socktype = SOCK_STREAM;
+        // Choose an IP for us
+        hints.ai_flags = AI_PASSIVE;
+
+        // Obtain a linked-list of IP addresses that fit the criteria
+        struct addrinfo* server_info;
+        auto gai_ret = getaddrinfo(nullptr, port.c_str(), &hints, &server_info);
+        if (gai_ret != 0) {
+            struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
+            throw error;
+        }
+
+        // Loop through the list to find a valid IP address to bind to
+        struct addrinfo* i;
+        for (i = server_info; i != nullptr; i = i->ai_next) {
+            // Create a new socket
+            this->sockfd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+            if (this->sockfd == -1) {
+                continue;
+            }
+
+            // Avoid errors when another socket recently stopped listening on
+            // the same port
+            int yes = 1;
+            if (setsockopt(*this->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
+                           sizeof yes) == -1) {
+                struct TcpError error = {errno, "couldn't set socket options"};
+                throw error;
+            }
+
+            // Bind the socket
+            if (::bind(*this->sockfd, i->ai_addr, i->ai_addrlen) == -1) {
+                close(*this->sockfd);
+                continue;
+            }
+
+            break;
+        }
+
+        // Not calling this would leak the memory used by the list
+        freeaddrinfo(server_info);
+
+        // If "i" is still null here, that means no suitable IP addresses were
+        // found
+        if (i == nullptr) {
+            this->sockfd = std::nullopt;
+
+            struct TcpError error = {1, "couldn't bind to any address"};
+            throw error;
+        }
+    }
+
+    // Listen for connections and accept the first incoming one
+    //
+    // With a spool, the messages it holds are delivered before returning. If
+    // one of them can't be written, the error is thrown as if accepting had
+    // failed: the socket is left disconnected and the messages stay spooled
+    void accept() {
+        if (!this->is_bound()) {
+            struct TcpError error = {-2, "socket unbound"};
+            throw error;
+        }
+        if (this->is_connected()) {
+            struct TcpError error = {-1, "socket already connected"};
+            throw error;
+        }
+
+        // Start listening
+        if (listen(*this->sockfd, 1) == -1) {
+            struct TcpError error = {errno, "couldn't listen for connections"};
+            throw error;
+        }
+
+        // Loop until a connection is successfully accepted
+        struct sockaddr_storage remote_addr;
+        socklen_t sin_len = sizeof remote_addr;
+        while (true) {
+            // Accept a connection
+            auto fd = ::accept(*this->sockfd, (struct sockaddr*)&remote_addr,
+                               &sin_len);
+
+            if (fd != -1) {
+                this->remote_sockfd = fd;
+                break;
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                // The listening socket was shut down or is out of resources
+                struct TcpError error = {errno, "couldn't accept connection"};
+                throw error;
+            }
+        }
+
+        NIX_TCP_PROBE(accept, *this->sockfd, *this->remote_sockfd);
+        TcpMetrics::add(TcpMetrics::connections_opened);
+        this->connected();
+    }
+
+    // Connect to a remote socket
+    //
+    // With a spool, the messages it holds are delivered before returning. If
+    // one of them can't be written, the error is thrown as if connecting had
+    // failed: the socket is left disconnected and the messages stay spooled
+    void connect(std::string const& remote, std::string const& port) {
+        if (!this->is_bound()) {
+            struct TcpError error = {-2, "socket unbound"};
+            throw error;
+        }
+        if (this->is_connected()) {
+            struct TcpError error = {-1, "socket already connected"};
+            throw error;
+        }
+
+        // Basic information about the remote
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        // Obtain a linked-list of IP addresses that fit the criteria
+        struct addrinfo* server_info;
+        auto gai_ret =
+            getaddrinfo(remote.c_str(), port.c_str(), &hints, &server_info);
+        if (gai_ret != 0) {
+            struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
+            throw error;
+        }
+
+        // Loop through the list to find a valid IP address to connect to
+        struct addrinfo* i;
+        for (i = server_info; i != nullptr; i = i->ai_next) {
+            // Create a new remote socket
+            this->remote_sockfd =
+                socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+            if (this->remote_sockfd == -1) {
+                continue;
+            }
+
+            // Bind the socket
+            if (::connect(*this->remote_sockfd, i->ai_addr, i->ai_addrlen) ==
+                -1) {
+                close(*this->remote_sockfd);
+                continue;
+            }
+
+            break;
+        }
+
+        // If "i" is still null here, that means no suitable IP addresses were
+        // found
+        if (i == nullptr) {
+            this->remote_sockfd = std::nullopt;
+
+            struct TcpError error = {1, "couldn't connect to any address"};
+            throw error;
+        }
+
+        // Not calling this would leak the memory used by the list
+        freeaddrinfo(server_info);
+
+        NIX_TCP_PROBE(connect, *this->remote_sockfd);
+        TcpMetrics::add(TcpMetrics::connections_opened);
+        this->connected();
+    }
+
+    // Send data
+    void send(std::vector<uint8_t> const& data) { this->send(data, 0); }
+    void send(std::pmr::vector<uint8_t> const& data) { this->send(data, 0); }
+
+    // Send data, ahead of any queued message with a lower priority
+    //
+    // Messages sent concurrently from several threads are queued and written
+    // one after the other by whichever thread got to the socket first, highest
+    // priority first. A message only preempts the one already being written if
+    // preempting is enabled (see set_preempting)
+    void send(std::vector<uint8_t> const& data, uint8_t priority) {
+        this->send(data.data(), data.size(), priority);
+    }
+    void send(std::pmr::vector<uint8_t> const& data, uint8_t priority) {
+        this->send(data.data(), data.size(), priority);
+    }
+    void send(uint8_t const* data, size_t size, uint8_t priority) {
+        if (this->spool != nullptr) {
+            this->send_spooled(data, size, priority);
+            return;
+        }
+        this->send_message(data, size, priority);
+    }
+
+    // Receive a message
+    std::vector<uint8_t> recv() {
+        std::vector<uint8_t> data;
+        this->recv_message(data);
+        return data;
+    }
+
+    // Receive a message allocated from "arena", as is the buffer used to
+    // read it
+    std::pmr::vector<uint8_t> recv(std::pmr::memory_resource& arena) {
+        std::pmr::vector<uint8_t> data(&arena);
+        this->recv_message(data);
+        return data;
+    }
+};
+
+// Forwards messages from one socket to another without copying their payload
+// to user space
+//
+// Only the chunk lengths are read by the relay, the packets themselves are
+// moved between the sockets by the kernel through a pipe
+class TcpRelay {
+    // Pipe used as an in-kernel buffer (read end, write end)
+    int pipefd[2];
+    // Number of bytes currently sitting in the pipe
+    size_t buffered;
+
+    // Move a packet from the source socket into the pipe, flushing the pipe
+    // to the destination socket whenever it fills up
+    //
+    // Every splice from a socket can take up a whole pipe slot, so the pipe
+    // usually runs out of slots long before it runs out of bytes
+    void fill(TcpSocket& src, TcpSocket& dst, size_t len) {
+        while (len > 0) {
+            auto moved =
+                splice(*src.remote_sockfd, nullptr, this->pipefd[1], nullptr,
+                       len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN && this->buffered > 0) {
+                    this->drain(dst);
+                    continue;
+                }
+                struct TcpError error = {errno, "couldn't relay data"};
+                throw error;
+            } else if (moved == 0) {
+                struct TcpError error = {1, "connection closed while relaying"};
+                throw error;
+            }
+            len -= moved;
+            this->buffered += moved;
+        }
+    }
+
+    // Write everything currently in the pipe to the destination socket
+    void drain(TcpSocket& dst) {
+        while (this->buffered > 0) {
+            auto moved = splice(this->pipefd[0], nullptr, *dst.remote_sockfd,
+                                nullptr, this->buffered,
+                                SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                struct TcpError error = {errno, "couldn't relay data"};
+                throw error;
+            }
+            this->buffered -= moved;
+        }
+    }
+
+    // Move the packets of a message from "src" to "dst", the first one
+    // starting with "count" unless the message is "announced"
+    void move(TcpSocket& src, TcpSocket& dst, uint8_t count,
+              std::optional<size_t> announced) {
+        auto packet_len = src.recv_packet_len;
+        ssize_t received;
+
+        if (announced.has_value()) {
+            auto len = (1 + TcpPacketEncoder::packets(packet_len, *announced)) *
+                       packet_len;
+            this->fill(src, dst, len);
+            this->drain(dst);
+            NIX_TCP_PROBE(relay, *src.remote_sockfd, *dst.remote_sockfd, len);
+            return;
+        }
+
+        size_t forwarded = 0;
+        while (true) {
+            // Move the whole packet into the pipe
+            this->fill(src, dst, packet_len);
+
+            forwarded += packet_len;
+
+            // If the chunk length is smaller than the max length it was the
+            // last packet
+            if (count < packet_len - 1) {
+                this->drain(dst);
+                break;
+            }
+
+            // Only the chunk length of the next packet is needed, unless it
+            // starts an urgent message, which is forwarded whole
+            while (true) {
+                received = ::recv(*src.remote_sockfd, &count, 1,
+                                  MSG_PEEK | MSG_WAITALL);
+                if (received == -1) {
+                    struct TcpError error = {errno, "couldn't receive data"};
+                    throw error;
+                } else if (received != 1) {
+                    struct TcpError error = {1,
+                                             "invalid received packet length"};
+                    throw error;
+                }
+                if (count != TcpPacketEncoder::control) {
+                    break;
+                }
+
+                std::vector<uint8_t> marker(packet_len);
+                received = ::recv(*src.remote_sockfd, marker.data(),
+                                  marker.size(), MSG_PEEK | MSG_WAITALL);
+                if (received != (ssize_t)marker.size() ||
+                    marker[1] != TcpPacketEncoder::urgent) {
+                    struct TcpError error = {1, "invalid control packet"};
+                    throw error;
+                }
+                auto len = (1 + TcpPacketEncoder::packets(
+                                    packet_len,
+                                    TcpPacketDecoder::announced_size(
+                                        packet_len, marker.data(),
+                                        src.max_message))) *
+                           packet_len;
+                this->fill(src, dst, len);
+                forwarded += len;
+            }
+        }
+
+        NIX_TCP_PROBE(relay, *src.remote_sockfd, *dst.remote_sockfd,
+                      forwarded);
+    }
+
+    static void check(TcpSocket& socket) {
+        if (!socket.is_bound()) {
+            struct TcpError error = {-2, "socket unbound"};
+            throw error;
+        }
+        if (!socket.is_connected()) {
+            struct TcpError error = {-2, "socket disconnected"};
+            throw error;
+        }
+    }
+
+  public:
+    TcpRelay() {
+        if (pipe2(this->pipefd, O_CLOEXEC) == -1) {
+            struct TcpError error = {errno, "couldn't create relay pipe"};
+            throw error;
+        }
+
+        // Larger pipes have more slots, so more packets can be forwarded per
+        // splice to the destination
+        fcntl(this->pipefd[1], F_SETPIPE_SZ, 1 << 20);
+        this->buffered = 0;
+    }
+    TcpRelay(TcpRelay const&) = delete;
+    TcpRelay& operator=(TcpRelay const&) = delete;
+
+    // Close the pipe on drop
+    ~TcpRelay() {
+        close(this->pipefd[0]);
+        close(this->pipefd[1]);
+    }
+
+    // Forward a single message from "src" to "dst"
+    void forward(TcpSocket& src, TcpSocket& dst) {
+        this->forward(src, [&](std::vector<uint8_t> const&) -> TcpSocket& {
+            return dst;
+        });
+    }
+
+    // Forward a single message from "src" to the socket chosen by "route",
+    // which is given the first packet of the message (chunk length included)
+    void forward(
+        TcpSocket& src,
+        std::function<TcpSocket&(std::vector<uint8_t> const&)> const& route) {
+        check(src);
+
+        // Peek at the first packet so the route can look at its content
+        std::vector<uint8_t> first;
+        std::optional<size_t> announced;
+        ssize_t received;
+        while (true) {
+            first.assign(src.recv_packet_len, 0);
+            received = ::recv(*src.remote_sockfd, first.data(), first.size(),
+                              MSG_PEEK | MSG_WAITALL);
+            if (received == -1) {
+                struct TcpError error = {errno, "couldn't receive data"};
+                throw error;
+            } else if (received != (ssize_t)first.size()) {
+                struct TcpError error = {1, "invalid received packet length"};
+                throw error;
+            }
+            if (first[0] != TcpPacketEncoder::control) {
+                break;
+            }
+
+            // An announced message is forwarded whole, announcement included,
+            // the route looking at the packet after it
+            if (first[1] == TcpPacketEncoder::announce ||
+                first[1] == TcpPacketEncoder::urgent) {
+                announced = TcpPacketDecoder::announced_size(
+                    src.recv_packet_len, first.data(), src.max_message);
+                if (*announced > 0) {
+                    auto packet_len = first.size();
+                    first.resize(2 * packet_len);
+                    received = ::recv(*src.remote_sockfd, first.data(),
+                                      first.size(), MSG_PEEK | MSG_WAITALL);
+                    if (received != (ssize_t)first.size()) {
+                        struct TcpError error = {errno,
+                                                 "couldn't receive data"};
+                        throw error;
+                    }
+                    first.erase(first.begin(), first.begin() + packet_len);
+                }
+                break;
+            }
+
+            // Control packets are consumed here, the destination being told
+            // about a new length only once a message is routed to it
+            uint8_t packet_len = src.recv_packet_len;
+            TcpPacketDecoder::apply(packet_len, first.data());
+            received = ::recv(*src.remote_sockfd, first.data(), first.size(),
+                              MSG_WAITALL);
+            if (received != (ssize_t)first.size()) {
+                struct TcpError error = {errno, "couldn't receive data"};
+                throw error;
+            }
+            src.recv_packet_len = packet_len;
+        }
+        auto packet_len = src.recv_packet_len;
+
+        auto& dst = route(first);
+        check(dst);
+
+        // Nothing else can be written to the destination in the middle of the
+        // message, so the relay is its writer until the message is through
+        dst.acquire_writer();
+        try {
+            // Packets are moved untouched, so the destination has to switch
+            // to the length of the source
+            if (dst.packet_len != packet_len) {
+                dst.resize_packets(packet_len);
+            }
+            this->move(src, dst, first[0], announced);
+        } catch (TcpError&) {
+            dst.release_writer();
+            throw;
+        }
+        dst.release_writer();
+    }
+};
+
+// Client spreading requests over connections to several backends
+//
+// Every request goes to the less loaded of two randomly picked backends, the
+// load of a backend being its number of requests in flight weighted by a
+// moving average of its latency. Backends failing requests are avoided for a
+// while, longer with every failure in a row
+//
+// Idempotent requests can also be hedged: if no response came back after a
+// delay, the request is sent again to another backend and whichever response
+// arrives first is used
+class TcpBalancer {
+    struct Backend {
+        std::string remote;
+        std::string port;
+
+        // Connection to the backend, opened lazily and dropped on errors
+        std::unique_ptr<TcpSocket> socket;
+        // Held for the duration of a request so responses aren't mixed up
+        std::mutex lock;
+        // Responses to cancelled hedged requests still on the way, the
+        // connection is replaced rather than reused while there are any
+        size_t stale;
+
+        // Requests currently waiting on or using the connection, cancelled
+        // ones included
+        std::atomic<uint32_t> in_flight;
+        // Moving average of the request latency in nanoseconds (0 if unknown)
+        std::atomic<uint64_t> latency;
+        // Requests failed in a row, and the time until which the backend is
+        // avoided because of them (in steady clock nanoseconds)
+        std::atomic<uint32_t> failures;
+        std::atomic<int64_t> ejected_until;
+    };
+
+    std::vector<std::unique_ptr<Backend>> backends;
+    uint8_t packet_len;
+
+    // Latencies of the most recent requests, used to pick the hedging delay
+    std::vector<uint64_t> samples;
+    size_t next_sample;
+    std::mutex samples_lock;
+
+    // Weight of the newest sample in the latency moving average
+    static constexpr double latency_weight = 0.2;
+    // Number of latencies kept to compute percentiles
+    static constexpr size_t samples_capacity = 256;
+    // Number of latencies needed before the hedging delay can be trusted
+    static constexpr size_t samples_min = 32;
+    // Latency assumed for backends when none of them answered yet
+    static constexpr uint64_t default_latency = 1000000;
+    // How long a failing backend is avoided, doubling with every failure in
+    // a row up to the max
+    static constexpr std::chrono::milliseconds ejection_base{100};
+    static constexpr std::chrono::milliseconds ejection_max{10000};
+
+    static std::minstd_rand& rng() {
+        thread_local std::minstd_rand rng(std::random_device{}());
+        return rng;
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Latency assumed for a backend that never answered: the average latency
+    // of the ones that did
+    uint64_t seed_latency() {
+        uint64_t total = 0;
+        size_t known = 0;
+        for (auto const& backend : this->backends) {
+            auto latency = backend->latency.load(std::memory_order_relaxed);
+            if (latency != 0) {
+                total += latency;
+                known++;
+            }
+        }
+        return known == 0 ? default_latency : total / known;
+    }
+
+    // Load of a backend, comparable between backends
+    double load(Backend const& backend) {
+        auto latency = backend.latency.load(std::memory_order_relaxed);
+        if (latency == 0) {
+            latency = this->seed_latency();
+        }
+        auto in_flight = backend.in_flight.load(std::memory_order_relaxed);
+        return (double)latency * (in_flight + 1);
+    }
+
+    // Get a backend ready to send a request, the backend lock must be held
+    void prepare(Backend& backend) {
+        // Responses nobody waits for anymore may take as long as the request
+        // that was hedged for being slow, so rather than waiting for them
+        // the connection is replaced
+        if (backend.stale > 0) {
+            this->drop(backend);
+        }
+
+        if (!backend.socket) {
+            backend.socket = std::make_unique<TcpSocket>(this->packet_len);
+            backend.socket->bind("0");
+            backend.socket->connect(backend.remote, backend.port);
+        }
+    }
+
+    // Drop the connection to a backend, the backend lock must be held
+    void drop(Backend& backend) {
+        backend.socket.reset();
+        backend.in_flight -= backend.stale;
+        backend.stale = 0;
+    }
+
+    // Drop the connection to a backend after an error, and avoid the backend
+    // for a while, the backend lock must be held
+    void reset(Backend& backend) {
+        this->drop(backend);
+
+        auto failures = std::min(backend.failures++, (uint32_t)16);
+        auto ejection = std::min(ejection_base * ((int64_t)1 << failures),
+                                 ejection_max);
+        backend.ejected_until.store(
+            now() + std::chrono::nanoseconds(ejection).count(),
+            std::memory_order_relaxed);
+    }
+
+    // Record the latency of a completed request
+    void record(Backend& backend, std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+        auto latency = backend.latency.load(std::memory_order_relaxed);
+        latency = latency == 0 ? elapsed
+                               : latency + latency_weight *
+                                               ((double)elapsed - latency);
+        backend.latency.store(latency, std::memory_order_relaxed);
+        backend.failures = 0;
+        backend.ejected_until.store(0, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> guard(this->samples_lock);
+        if (this->samples.size() < samples_capacity) {
+            this->samples.push_back(elapsed);
+        } else {
+            this->samples[this->next_sample] = elapsed;
+        }
+        this->next_sample = (this->next_sample + 1) % samples_capacity;
+    }
+
+  public:
+    // Create a balancer over a list of (remote, port) pairs
+    TcpBalancer(std::vector<std::pair<std::string, std::string>> const& hosts,
+                uint8_t packet_len) {
+        if (hosts.empty()) {
+            struct TcpError error = {-1, "no backends to balance over"};
+            throw error;
+        }
+
+        for (auto const& host : hosts) {
+            auto backend = std::make_unique<Backend>();
+            backend->remote = host.first;
+            backend->port = host.second;
+            backend->stale = 0;
+            backend->in_flight = 0;
+            backend->latency = 0;
+            backend->failures = 0;
+            backend->ejected_until = 0;
+            this->backends.push_back(std::move(backend));
+        }
+
+        this->packet_len = packet_len;
+        this->next_sample = 0;
+    }
+    TcpBalancer(std::vector<std::pair<std::string, std::string>> const& hosts)
+        : TcpBalancer(hosts, 64) {}
+
+    // Number of backends
+    size_t size() { return this->backends.size(); }
+    // Number of requests in flight on a backend
+    uint32_t in_flight(size_t backend) {
+        return this->backends[backend]->in_flight.load();
+    }
+    // Moving average of the latency of a backend
+    std::chrono::nanoseconds latency(size_t backend) {
+        return std::chrono::nanoseconds(
+            this->backends[backend]->latency.load());
+    }
+
+    // Latency percentile ("quantile" between 0 and 1) over the most recent
+    // requests, if enough of them completed already
+    std::optional<std::chrono::nanoseconds> percentile(double quantile) {
+        std::vector<uint64_t> sorted;
+        {
+            std::lock_guard<std::mutex> guard(this->samples_lock);
+            if (this->samples.size() < samples_min) {
+                return std::nullopt;
+            }
+            sorted = this->samples;
+        }
+
+        auto nth = sorted.begin() + (size_t)(quantile * (sorted.size() - 1));
+        std::nth_element(sorted.begin(), nth, sorted.end());
+        return std::chrono::nanoseconds(*nth);
+    }
+
+    // Pick the less loaded of two random backends, avoiding "exclude" if
+    // another backend is available, and backends that failed lately unless
+    // both did
+    size_t pick(std::optional<size_t> exclude = std::nullopt) {
+        auto count = this->backends.size();
+        if (exclude.has_value() && count > 1) {
+            count--;
+        }
+        if (count == 1) {
+            return exclude == 0 && this->backends.size() > 1 ? 1 : 0;
+        }
+
+        auto& rng = TcpBalancer::rng();
+        size_t a = rng() % count;
+        // Draw the second one among the others so the two are distinct
+        size_t b = (a + 1 + rng() % (count - 1)) % count;
+        // Skip over the excluded backend
+        if (exclude.has_value()) {
+            a += a >= *exclude;
+            b += b >= *exclude;
+        }
+
+        auto& first = *this->backends[a];
+        auto& second = *this->backends[b];
+        auto time = now();
+        auto first_until = first.ejected_until.load(std::memory_order_relaxed);
+        auto second_until =
+            second.ejected_until.load(std::memory_order_relaxed);
+        if ((first_until > time) != (second_until > time)) {
+            return first_until > time ? b : a;
+        } else if (first_until > time) {
+            // The one back the soonest
+            return second_until < first_until ? b : a;
+        }
+        return this->load(second) < this->load(first) ? b : a;
+    }
+
+    // Send a request to one of the backends and wait for its response
+    std::vector<uint8_t> request(std::vector<uint8_t> const& data) {
+        return this->request(this->pick(), data);
+    }
+
+    // Send a request to a specific backend and wait for its response
+    std::vector<uint8_t> request(size_t index,
+                                 std::vector<uint8_t> const& data) {
+        auto& backend = *this->backends[index];
+
+        backend.in_flight++;
+        std::lock_guard<std::mutex> guard(backend.lock);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<uint8_t> response;
+        try {
+            this->prepare(backend);
+            backend.socket->send(data);
+            response = backend.socket->recv();
+        } catch (TcpError&) {
+            // The connection is in an unknown state, start over next time
+            this->reset(backend);
+            backend.in_flight--;
+            throw;
+        }
+
+        this->record(backend, start);
+        backend.in_flight--;
+
+        return response;
+    }
+
+    // Send an idempotent request, hedging it once the 95th latency percentile
+    // is exceeded
+    std::vector<uint8_t> hedged_request(std::vector<uint8_t> const& data) {
+        auto delay = this->percentile(0.95);
+        if (!delay.has_value()) {
+            return this->request(data);
+        }
+        return this->hedged_request(data, *delay);
+    }
+
+    // Send an idempotent request, sending it to a second backend if no
+    // response came back after "delay"
+    std::vector<uint8_t> hedged_request(std::vector<uint8_t> const& data,
+                                        std::chrono::nanoseconds delay) {
+        auto primary_index = this->pick();
+        auto& primary = *this->backends[primary_index];
+
+        primary.in_flight++;
+        std::unique_lock<std::mutex> primary_guard(primary.lock);
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            this->prepare(primary);
+            primary.socket->send(data);
+        } catch (TcpError&) {
+            this->reset(primary);
+            primary.in_flight--;
+            throw;
+        }
+
+        struct pollfd fds[2];
+        fds[0] = {*primary.socket->remote_sockfd, POLLIN, 0};
+        auto timeout =
+            std::chrono::ceil<std::chrono::milliseconds>(delay).count();
+        auto ready = poll(fds, 1, (int)timeout);
+
+        // Only hedge with a backend that is idle right now, waiting for
+        // another one could take longer than waiting for the primary
+        Backend* secondary = nullptr;
+        std::unique_lock<std::mutex> secondary_guard;
+        auto secondary_start = start;
+        if (ready == 0 && this->backends.size() > 1) {
+            auto& candidate = *this->backends[this->pick(primary_index)];
+            secondary_guard =
+                std::unique_lock<std::mutex>(candidate.lock, std::try_to_lock);
+            if (secondary_guard.owns_lock()) {
+                secondary = &candidate;
+                secondary->in_flight++;
+                secondary_start = std::chrono::steady_clock::now();
+                try {
+                    this->prepare(*secondary);
+                    secondary->socket->send(data);
+                } catch (TcpError&) {
+                    // The primary may still answer
+                    this->reset(*secondary);
+                    secondary->in_flight--;
+                    secondary = nullptr;
+                    secondary_guard.unlock();
+                }
+            }
+        }
+
+        // Wait for the first response
+        auto count = 1;
+        if (secondary != nullptr) {
+            fds[1] = {*secondary->socket->remote_sockfd, POLLIN, 0};
+            count = 2;
+        }
+        do {
+            ready = poll(fds, count, -1);
+        } while (ready == -1 && errno == EINTR);
+        if (ready == -1) {
+            struct TcpError error = {errno, "couldn't wait for a response"};
+            for (auto backend : {&primary, secondary}) {
+                if (backend != nullptr) {
+                    this->reset(*backend);
+                    backend->in_flight--;
+                }
+            }
+            throw error;
+        }
+
+        auto& winner =
+            count == 2 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+                ? *secondary
+                : primary;
+        auto loser = &winner == &primary ? secondary : &primary;
+        // Each backend is timed from when it was sent the request
+        auto started = [&](Backend& backend) {
+            return &backend == &primary ? start : secondary_start;
+        };
+
+        std::vector<uint8_t> response;
+        try {
+            response = winner.socket->recv();
+        } catch (TcpError&) {
+            this->reset(winner);
+            winner.in_flight--;
+            if (loser == nullptr) {
+                throw;
+            }
+
+            // The other backend may still answer
+            try {
+                response = loser->socket->recv();
+            } catch (TcpError&) {
+                this->reset(*loser);
+                loser->in_flight--;
+                throw;
+            }
+            this->record(*loser, started(*loser));
+            loser->in_flight--;
+            return response;
+        }
+
+        // The other response is left for the next request to discard
+        if (loser != nullptr) {
+            loser->stale++;
+        }
+        this->record(winner, started(winner));
+        winner.in_flight--;
+
+        return response;
+    }
+};
+
+// Adaptive limit on the number of requests a server works on concurrently
+//
+// The limit grows by one every time a whole limit's worth of requests
+// completed without queueing up, and shrinks by a fraction when requests take
+// notably longer than the fastest recent ones (additive increase,
+// multiplicative decrease). Requests already under way when the limit shrank
+// can't tell whether it helped, so their being slow doesn't shrink it again
+class TcpConcurrencyLimit {
+    std::mutex lock;
+
+    double limit;
+    double min_limit;
+    double max_limit;
+    uint32_t in_flight;
+
+    // Fastest latency seen in the current window, in nanoseconds
+    uint64_t min_latency;
+    // Fastest latency seen in the previous window, used as the reference
+    uint64_t base_latency;
+    uint32_t window_samples;
+    // When the limit last shrank
+    std::chrono::steady_clock::time_point last_decrease;
+
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> rejected;
+
+    // A request slower than the reference times this is considered queued
+    static constexpr double tolerance = 2.0;
+    // Fraction the limit is multiplied with when requests get queued
+    static constexpr double backoff = 0.9;
+    // Number of samples after which the reference latency is refreshed
+    static constexpr uint32_t window = 1000;
+
+  public:
+    TcpConcurrencyLimit(uint32_t initial, uint32_t min, uint32_t max) {
+        this->limit = initial;
+        this->min_limit = min;
+        this->max_limit = max;
+        this->in_flight = 0;
+
+        this->min_latency = UINT64_MAX;
+        this->base_latency = UINT64_MAX;
+        this->window_samples = 0;
+        this->last_decrease = std::chrono::steady_clock::time_point::min();
+
+        this->accepted = 0;
+        this->rejected = 0;
+    }
+    TcpConcurrencyLimit() : TcpConcurrencyLimit(16, 1, 1024) {}
+
+    // Current limit
+    uint32_t current() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return (uint32_t)this->limit;
+    }
+    // Number of requests admitted
+    uint64_t admitted() { return this->accepted.load(); }
+    // Number of requests turned away because the limit was reached
+    uint64_t rejections() { return this->rejected.load(); }
+
+    // Try to start working on a request, returns false if the server is at
+    // capacity and the request should be rejected
+    bool try_acquire() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->in_flight >= (uint32_t)this->limit) {
+            this->rejected++;
+            TcpMetrics::add(TcpMetrics::requests_rejected);
+            return false;
+        }
+
+        this->in_flight++;
+        this->accepted++;
+        return true;
+    }
+
+    // Finish working on a request admitted by "try_acquire", which took
+    // "latency" until now
+    void release(std::chrono::nanoseconds latency) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->in_flight--;
+
+        uint64_t sample = latency.count();
+        this->min_latency = std::min(this->min_latency, sample);
+        if (++this->window_samples >= window) {
+            this->base_latency = this->min_latency;
+            this->min_latency = UINT64_MAX;
+            this->window_samples = 0;
+        }
+
+        auto reference = std::min(this->base_latency, this->min_latency);
+        if (sample > reference * tolerance) {
+            // At most once per round trip, a burst of slow requests being one
+            // and the same congestion
+            auto now = std::chrono::steady_clock::now();
+            if (now - latency >= this->last_decrease) {
+                this->limit = std::max(this->min_limit, this->limit * backoff);
+                this->last_decrease = now;
+            }
+        } else {
+            this->limit =
+                std::min(this->max_limit, this->limit + 1.0 / this->limit);
+        }
+    }
+};
+
+// Queue of incoming requests shedding work with the CoDel algorithm
+//
+// Requests are dropped when they keep spending more than "target" in the
+// queue for at least "interval", at a rate increasing until the queueing
+// delay goes back under the target. Dropped requests are handed to a callback
+// so the server can tell the client to back off
+template <typename T>
+class TcpCodelQueue {
+    struct Entry {
+        T item;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    std::mutex lock;
+    std::condition_variable available;
+    std::deque<Entry> entries;
+    size_t capacity;
+    bool closed;
+
+    std::chrono::nanoseconds target;
+    std::chrono::nanoseconds interval;
+    std::function<void(T&&)> on_drop;
+
+    // Control loop state, named after RFC 8289
+    clock::time_point first_above_time;
+    clock::time_point drop_next;
+    uint32_t count;
+    uint32_t last_count;
+    bool dropping;
+
+    std::atomic<uint64_t> pushed;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> dropped;
+
+    clock::time_point control_law(clock::time_point t) {
+        return t + std::chrono::duration_cast<clock::duration>(
+                       this->interval / std::sqrt((double)this->count));
+    }
+
+    // Pop the head of the queue and tell whether it may be dropped
+    std::optional<T> pop_head(clock::time_point now, bool& ok_to_drop) {
+        ok_to_drop = false;
+        if (this->entries.empty()) {
+            this->first_above_time = clock::time_point();
+            return std::nullopt;
+        }
+
+        auto entry = std::move(this->entries.front());
+        this->entries.pop_front();
+
+        auto sojourn = now - entry.enqueued;
+        if (sojourn < this->target || this->entries.empty()) {
+            this->first_above_time = clock::time_point();
+        } else if (this->first_above_time == clock::time_point()) {
+            this->first_above_time = now + this->interval;
+        } else if (now >= this->first_above_time) {
+            ok_to_drop = true;
+        }
+
+        return std::move(entry.item);
+    }
+
+    void drop(T&& item) {
+        this->dropped++;
+        NIX_TCP_PROBE(request__drop, this->entries.size(), this->count);
+        TcpMetrics::add(TcpMetrics::requests_dropped);
+        if (this->on_drop) {
+            this->on_drop(std::move(item));
+        }
+    }
+
+  public:
+    TcpCodelQueue(size_t capacity, std::chrono::nanoseconds target,
+                  std::chrono::nanoseconds interval,
+                  std::function<void(T&&)> on_drop) {
+        this->capacity = capacity;
+        this->closed = false;
+
+        this->target = target;
+        this->interval = interval;
+        this->on_drop = std::move(on_drop);
+
+        this->count = 0;
+        this->last_count = 0;
+        this->dropping = false;
+
+        this->pushed = 0;
+        this->rejected = 0;
+        this->dropped = 0;
+    }
+    TcpCodelQueue(size_t capacity, std::function<void(T&&)> on_drop)
+        : TcpCodelQueue(capacity, std::chrono::milliseconds(5),
+                        std::chrono::milliseconds(100), std::move(on_drop)) {}
+
+    // Number of requests queued
+    uint64_t enqueued() { return this->pushed.load(); }
+    // Number of requests rejected because the queue was full or closed
+    uint64_t rejections() { return this->rejected.load(); }
+    // Number of requests dropped because of their queueing delay
+    uint64_t drops() { return this->dropped.load(); }
+    // Number of requests currently waiting
+    size_t size() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->entries.size();
+    }
+
+    // Queue a request, returns false if it was rejected
+    bool push(T item) {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (this->closed || this->entries.size() >= this->capacity) {
+                this->rejected++;
+                TcpMetrics::add(TcpMetrics::requests_rejected);
+                return false;
+            }
+            this->entries.push_back({std::move(item), clock::now()});
+            this->pushed++;
+        }
+        this->available.notify_one();
+        return true;
+    }
+
+    // Wake up every consumer, which will then get nothing once the queue is
+    // empty
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->closed = true;
+        }
+        this->available.notify_all();
+    }
+
+    // Wait for the next request worth working on, returns nothing once the
+    // queue is closed and empty
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> guard(this->lock);
+        while (true) {
+            this->available.wait(guard, [this] {
+                return this->closed || !this->entries.empty();
+            });
+            if (this->entries.empty()) {
+                return std::nullopt;
+            }
+
+            auto now = clock::now();
+            bool ok_to_drop;
+            auto item = this->pop_head(now, ok_to_drop);
+
+            // Drops happen outside the lock since the callback can be slow
+            std::vector<T> shed;
+            if (this->dropping) {
+                if (!ok_to_drop) {
+                    this->dropping = false;
+                }
+                while (item.has_value() && this->dropping &&
+                       now >= this->drop_next) {
+                    shed.push_back(std::move(*item));
+                    this->count++;
+                    item = this->pop_head(now, ok_to_drop);
+                    if (!ok_to_drop) {
+                        this->dropping = false;
+                    } else {
+                        this->drop_next = this->control_law(this->drop_next);
+                    }
+                }
+            } else if (ok_to_drop) {
+                shed.push_back(std::move(*item));
+                item = this->pop_head(now, ok_to_drop);
+                this->dropping = true;
+
+                // Start from a higher drop rate if dropping stopped recently
+                auto delta = this->count - this->last_count;
+                this->count = delta > 1 && now - this->drop_next <
+                                               16 * this->interval
+                                  ? delta
+                                  : 1;
+                this->drop_next = this->control_law(now);
+                this->last_count = this->count;
+            }
+
+            if (!shed.empty()) {
+                guard.unlock();
+                for (auto& request : shed) {
+                    this->drop(std::move(request));
+                }
+                guard.lock();
+            }
+
+            if (item.has_value()) {
+                return item;
+            }
+        }
+    }
+};
+
+// Spare buffers lent to connections only while they have data in flight, so
+// that idle connections hold none
+//
+// Not thread safe, meant to be used by a single event loop
+class TcpBufferPool {
+    std::vector<std::vector<uint8_t>> spare;
+    size_t spare_bytes;
+
+    // Most buffers and largest buffer kept around
+    size_t max_spare;
+    size_t max_capacity;
+
+  public:
+    TcpBufferPool(size_t max_spare, size_t max_capacity) {
+        this->spare_bytes = 0;
+        this->max_spare = max_spare;
+        this->max_capacity = max_capacity;
+    }
+    TcpBufferPool() : TcpBufferPool(64, 1 << 20) {}
+
+    // Borrow a buffer, without any memory if there is no spare one
+    //
+    // Its contents are whatever the previous borrower left in it
+    std::vector<uint8_t> acquire() {
+        if (this->spare.empty()) {
+            return std::vector<uint8_t>();
+        }
+        auto buffer = std::move(this->spare.back());
+        this->spare.pop_back();
+        this->spare_bytes -= buffer.capacity();
+        return buffer;
+    }
+
+    // Give a buffer back, freeing it instead if the pool is full or the
+    // buffer grew too large
+    void release(std::vector<uint8_t>&& buffer) {
+        if (buffer.capacity() > 0 && buffer.capacity() <= this->max_capacity &&
+            this->spare.size() < this->max_spare) {
+            this->spare_bytes += buffer.capacity();
+            this->spare.push_back(std::move(buffer));
+        }
+        buffer = std::vector<uint8_t>();
+    }
+
+    // Memory held by the spare buffers
+    size_t memory() { return this->spare_bytes; }
+};
+
+// Monotonic arena the allocations of a request are made from, all of them
+// freed at once when the request is done
+//
+// Allocations fitting in its initial buffer don't touch the heap, larger ones
+// get more memory from it until the arena is reset
+class TcpArena {
+    std::unique_ptr<uint8_t[]> buffer;
+    std::pmr::monotonic_buffer_resource monotonic;
+
+  public:
+    TcpArena(size_t size)
+        : buffer(new uint8_t[size]),
+          monotonic(buffer.get(), size, std::pmr::new_delete_resource()) {}
+    TcpArena(TcpArena const&) = delete;
+    TcpArena& operator=(TcpArena const&) = delete;
+
+    // Resource to allocate from
+    std::pmr::memory_resource& resource() { return this->monotonic; }
+
+    // Free everything allocated so far, and start over from the initial
+    // buffer
+    void reset() { this->monotonic.release(); }
+};
+
+// Arenas lent to requests and reset for the next ones once they are done
+//
+// Thread safe, so that threads serving connections of their own can share it
+class TcpArenaPool {
+    std::vector<std::unique_ptr<TcpArena>> spare;
+    std::mutex lock;
+
+    // Size of the initial buffer of every arena, and most arenas kept around
+    size_t arena_size;
+    size_t max_spare;
+
+  public:
+    TcpArenaPool(size_t arena_size, size_t max_spare) {
+        this->arena_size = arena_size;
+        this->max_spare = max_spare;
+    }
+    TcpArenaPool() : TcpArenaPool(16 << 10, 64) {}
+    TcpArenaPool(TcpArenaPool const&) = delete;
+    TcpArenaPool& operator=(TcpArenaPool const&) = delete;
+
+    // Borrow an arena, a new one if there is no spare one
+    std::unique_ptr<TcpArena> acquire() {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            if (!this->spare.empty()) {
+                auto arena = std::move(this->spare.back());
+                this->spare.pop_back();
+                return arena;
+            }
+        }
+        return std::make_unique<TcpArena>(this->arena_size);
+    }
+
+    // Give an arena back, freeing everything allocated from it
+    void release(std::unique_ptr<TcpArena>&& arena) {
+        arena->reset();
+
+        std::lock_guard<std::mutex> guard(this->lock);
+        if (this->spare.size() < this->max_spare) {
+            this->spare.push_back(std::move(arena));
+        }
+        arena.reset();
+    }
+
+    // Memory held by the spare arenas
+    size_t memory() {
+        std::lock_guard<std::mutex> guard(this->lock);
+        return this->spare.size() * this->arena_size;
+    }
+};
+
+// Bounded queue any number of threads may push to and pop from without
+// taking a lock
+//
+// Every cell carries a sequence number telling whether it is free for the
+// next push or holds a value for the next pop, so that threads only contend
+// on the head or the tail they advance
+template <typename T>
+class TcpLockFreeQueue {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    // Kept on cache lines of their own, producers and consumers don't share
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+
+  public:
+    // Create a queue of at least "capacity" values, rounded up to a power of
+    // two
+    TcpLockFreeQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        this->cells.reset(new Cell[size]);
+        for (size_t i = 0; i < size; i++) {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        this->mask = size - 1;
+        this->head = 0;
+        this->tail = 0;
+    }
+    TcpLockFreeQueue(TcpLockFreeQueue const&) = delete;
+    TcpLockFreeQueue& operator=(TcpLockFreeQueue const&) = delete;
+
+    // Append a value, returns false if the queue is full
+    bool push(T const& value) {
+        auto position = this->head.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = this->cells[position & this->mask];
+            auto sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0) {
+                if (this->head.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(position + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = this->head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Take the oldest value, returns false if the queue is empty
+    bool pop(T& value) {
+        auto position = this->tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& cell = this->cells[position & this->mask];
+            auto sequence = cell.sequence.load(std::memory_order_acquire);
+            auto diff = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (diff == 0) {
+                if (this->tail.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(position + this->mask + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                position = this->tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+// Identifier of a connection accepted by a TcpServer
+//
+// The low half is the slot of the connection in the server and the high half
+// the generation of that slot, so that a handle outliving its connection is
+// rejected rather than reaching whichever connection took the slot over
+using TcpConnection = uint64_t;
+
+// Single threaded event loop serving many connections at once
+//
+// Connections with data to read are serviced in deficit round robin order:
+// every round, each of them may read up to a byte budget and handle up to a
+// message budget, unused bytes carrying over to the next round as long as the
+// connection stays busy. A connection always having data ready thus gets its
+// fair share of the loop but no more
+class TcpServer {
+    friend class TcpServerGroup;
+
+  public:
+    // Called with every message received on a connection
+    using Handler =
+        std::function<void(TcpServer&, TcpConnection, std::vector<uint8_t>&&)>;
+    // Called with every message received on a connection, along with an
+    // arena for whatever handling it allocates
+    using RequestHandler =
+        std::function<void(TcpServer&, TcpConnection, std::vector<uint8_t>&&,
+                           std::pmr::memory_resource&)>;
+    // Called once a connection was closed, by either side
+    using CloseHandler = std::function<void(TcpServer&, TcpConnection)>;
+    // Called on the server a connection migrated to, with its new handle and
+    // the one it had on its previous server
+    using MigrateHandler =
+        std::function<void(TcpServer&, TcpConnection, TcpConnection)>;
+
+    // Traffic of a connection since it was accepted
+    struct Stats {
+        uint64_t bytes_received;
+        uint64_t bytes_sent;
+        uint64_t messages_received;
+        uint64_t messages_sent;
+        std::chrono::steady_clock::time_point opened;
+    };
+
+  private:
+    // Fields touched on every event, two connections to a cache line
+    struct alignas(32) Hot {
+        int fd;
+        // Bumped every time the slot is freed, so that handles to a closed
+        // connection never reach the one reusing its slot
+        uint32_t generation;
+        // Bytes of output already written
+        size_t output_offset;
+        // Bytes the connection may still read this round
+        size_t deficit;
+        // Received bytes not decoded yet
+        uint32_t input_len;
+        // Whether the slot holds a connection
+        bool used;
+        // Whether the connection is waiting in the round robin
+        bool active;
+        // Whether the connection waits for its socket to become writable
+        bool writing;
+        // Whether the connection is about to be torn down
+        bool closed;
+    };
+    static_assert(sizeof(Hot) == 32, "hot connection state must stay small");
+
+    // Fields only needed once data actually flows, or on request
+    struct Cold {
+        TcpPacketDecoder decoder;
+        // Received bytes, borrowed from the pool while some aren't handled
+        std::vector<uint8_t> input;
+        // Packets not written yet, borrowed from the pool until written
+        std::vector<uint8_t> output;
+
+        // Large enough for both IPv4 and IPv6 addresses, unlike the much
+        // larger sockaddr_storage
+        struct sockaddr_in6 address;
+        socklen_t address_len;
+        Stats stats;
+        // Identifier of the connection in the capture, 0 until recorded
+        uint64_t capture_id;
+        // Bytes moved by the connection when last ranked by activity
+        uint64_t mark;
+    };
+
+    // State of a connection moving to another server
+    struct Migration {
+        TcpConnection previous;
+        TcpPacketDecoder decoder;
+        std::vector<uint8_t> input;
+        size_t input_len;
+        std::vector<uint8_t> output;
+        size_t output_offset;
+        Stats stats;
+        uint64_t capture_id;
+    };
+
+    // Socket handed over by another thread, along with its state if it
+    // migrates from another server
+    struct Handoff {
+        int fd;
+        struct sockaddr_in6 address;
+        socklen_t address_len;
+        Migration* migration;
+    };
+
+    // Identifiers of the listening socket and of the wakeup event in the
+    // epoll set, never valid handles since generations start at 1
+    static constexpr TcpConnection listener = 0;
+    static constexpr TcpConnection wakeup = 1;
+    // Size of the receive buffer of each connection
+    static constexpr size_t input_capacity = 1 << 16;
+
+    std::optional<int> listenfd;
+    int epollfd;
+    // Event other threads wake the loop up with
+    int wakefd;
+    uint8_t packet_len;
+    // Largest message accepted from a connection
+    size_t max_message;
+
+    // Sockets handed over by other threads, and how many are on their way
+    TcpLockFreeQueue<Handoff> inbox;
+    std::atomic<size_t> handoffs;
+
+    // Connection slots, indexed by the low half of their handles
+    std::vector<Hot> hot;
+    std::vector<Cold> cold;
+    // Slots free for reuse, the most recently freed last
+    std::vector<uint32_t> free_slots;
+    std::atomic<size_t> used;
+    // Connections with data to read, in round robin order
+    std::deque<TcpConnection> ready;
+    // Connections to tear down at the end of the iteration
+    std::vector<TcpConnection> closing;
+    // Connections to move to other servers at the end of the iteration
+    std::vector<std::pair<TcpConnection, TcpServer*>> leaving;
+    // Buffers lent to the connections with data in flight
+    TcpBufferPool buffers;
+    // Arenas lent to requests while they are handled
+    TcpArenaPool arenas;
+    // Largest amount of output pending on a connection so far
+    size_t output_high;
+
+    // Bytes and messages each connection may handle per round
+    size_t quantum;
+    size_t frames;
+
+    Handler handler;
+    RequestHandler request_handler;
+    CloseHandler close_handler;
+    MigrateHandler migrate_handler;
+    std::atomic<bool> stopped;
+    // Bytes received and sent over all connections
+    std::atomic<uint64_t> bytes_moved;
+
+    // Tuner sizing the buffers of the connections, if any
+    TcpBufferTuner* tuner;
+    // Capture the messages are recorded to, if any
+    TcpCapture* capture;
+
+    static uint32_t slot_of(TcpConnection id) { return (uint32_t)id; }
+    TcpConnection handle(uint32_t slot) {
+        return (TcpConnection)this->hot[slot].generation << 32 | slot;
+    }
+
+    // Slot of an open connection, nullptr if the handle is stale
+    Hot* find(TcpConnection id) {
+        auto slot = slot_of(id);
+        if (slot >= this->hot.size()) {
+            return nullptr;
+        }
+        auto& entry = this->hot[slot];
+        if (!entry.used || entry.closed || this->handle(slot) != id) {
+            return nullptr;
+        }
+        return &entry;
+    }
+
+    void record(TcpConnection id, TcpCapture::Direction direction,
+                uint8_t const* data, size_t size) {
+        auto& connection = this->cold[slot_of(id)];
+        if (connection.capture_id == 0) {
+            connection.capture_id = this->capture->connection();
+        }
+        this->capture->record(connection.capture_id, direction, data, size);
+    }
+
+    // Hand a message to the request handler, with an arena reset once it
+    // is done
+    void handle(TcpConnection id, std::vector<uint8_t>&& message) {
+        auto arena = this->arenas.acquire();
+        this->request_handler(*this, id, std::move(message),
+                              arena->resource());
+        this->arenas.release(std::move(arena));
+    }
+
+    void watch(TcpConnection id) {
+        auto& entry = this->hot[slot_of(id)];
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof event);
+        event.events = EPOLLIN | EPOLLRDHUP;
+        if (entry.writing) {
+            event.events |= EPOLLOUT;
+        }
+        event.data.u64 = id;
+        epoll_ctl(this->epollfd, EPOLL_CTL_MOD, entry.fd, &event);
+    }
+
+    // Accept every pending connection
+    void accept_all() {
+        while (true) {
+            struct sockaddr_storage address;
+            socklen_t address_len = sizeof address;
+            auto fd = accept4(*this->listenfd, (struct sockaddr*)&address,
+                              &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+
+            NIX_TCP_PROBE(accept, *this->listenfd, fd);
+            TcpMetrics::add(TcpMetrics::connections_opened);
+            this->add(fd, (struct sockaddr*)&address, address_len);
+        }
+    }
+
+    // Start serving the sockets handed over since the last wakeup
+    void adopt_all() {
+        // Only resets the event, the sockets are in the inbox either way
+        uint64_t wakeups;
+        auto reset = ::read(this->wakefd, &wakeups, sizeof wakeups);
+        (void)reset;
+
+        Handoff handoff;
+        while (this->inbox.pop(handoff)) {
+            this->handoffs--;
+            auto id = this->add(handoff.fd, (struct sockaddr*)&handoff.address,
+                                handoff.address_len);
+            if (handoff.migration != nullptr) {
+                std::unique_ptr<Migration> migration(handoff.migration);
+                this->resume(id, *migration);
+            }
+        }
+    }
+
+    // Start serving a connected socket, returns its handle
+    TcpConnection add(int fd, struct sockaddr const* address,
+                      socklen_t address_len) {
+        uint32_t slot;
+        if (!this->free_slots.empty()) {
+            slot = this->free_slots.back();
+            this->free_slots.pop_back();
+        } else {
+            slot = this->hot.size();
+            this->hot.push_back(Hot{-1, 1, 0, 0, 0, false, false, false,
+                                    false});
+            this->cold.push_back(
+                Cold{TcpPacketDecoder(this->packet_len, this->max_message),
+                     {}, {}, {}, 0, {}, 0, 0});
+        }
+
+        auto& entry = this->hot[slot];
+        entry.fd = fd;
+        entry.used = true;
+        auto& connection = this->cold[slot];
+        connection.decoder =
+            TcpPacketDecoder(this->packet_len, this->max_message);
+        address_len = std::min(address_len,
+                               (socklen_t)sizeof connection.address);
+        std::memcpy(&connection.address, address, address_len);
+        connection.address_len = address_len;
+        connection.stats = Stats{0, 0, 0, 0, std::chrono::steady_clock::now()};
+        connection.capture_id = 0;
+        connection.mark = 0;
+        this->used++;
+
+        auto id = this->handle(slot);
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof event);
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = id;
+        if (epoll_ctl(this->epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            this->close(id);
+        }
+        return id;
+    }
+
+    // Resume serving a connection where its previous server left it
+    void resume(TcpConnection id, Migration& migration) {
+        auto entry = this->find(id);
+        if (entry == nullptr) {
+            return;
+        }
+
+        auto& connection = this->cold[slot_of(id)];
+        connection.decoder = std::move(migration.decoder);
+        connection.input = std::move(migration.input);
+        entry->input_len = migration.input_len;
+        connection.output = std::move(migration.output);
+        entry->output_offset = migration.output_offset;
+        connection.stats = migration.stats;
+        connection.capture_id = migration.capture_id;
+        connection.mark = migration.stats.bytes_received +
+                          migration.stats.bytes_sent;
+
+        // Output left over waits for the socket to be writable, and input
+        // left over for its turn, as they would have on the previous server
+        if (entry->output_offset < connection.output.size()) {
+            entry->writing = true;
+            this->watch(id);
+        }
+        if (entry->input_len > 0) {
+            entry->active = true;
+            this->ready.push_back(id);
+        }
+
+        if (this->migrate_handler) {
+            this->migrate_handler(*this, id, migration.previous);
+        }
+    }
+
+    // Write as much pending output as the socket takes
+    void flush(TcpConnection id) {
+        auto& entry = this->hot[slot_of(id)];
+        auto& connection = this->cold[slot_of(id)];
+        while (entry.output_offset < connection.output.size()) {
+            auto sent = ::send(entry.fd,
+                               connection.output.data() + entry.output_offset,
+                               connection.output.size() - entry.output_offset,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+            TcpMetrics::add(TcpMetrics::syscalls);
+            if (sent == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (!entry.writing) {
+                        entry.writing = true;
+                        this->watch(id);
+                    }
+                    return;
+                }
+                this->close(id);
+                return;
+            }
+            entry.output_offset += sent;
+            connection.stats.bytes_sent += sent;
+            this->bytes_moved.store(this->bytes_moved + sent,
+                                    std::memory_order_relaxed);
+            TcpMetrics::add(TcpMetrics::bytes_sent, sent);
+            TcpMetrics::adjust(TcpMetrics::pending_output_bytes, -sent);
+        }
+
+        this->buffers.release(std::move(connection.output));
+        entry.output_offset = 0;
+        if (entry.writing) {
+            entry.writing = false;
+            this->watch(id);
+        }
+    }
+
+    // Read and handle messages within the budgets of the connection, returns
+    // whether it should be serviced again next round
+    bool service(TcpConnection id) {
+        auto& entry = this->hot[slot_of(id)];
+        auto& connection = this->cold[slot_of(id)];
+        auto frames_left = this->frames;
+        auto drained = false;
+
+        while (true) {
+            // Handle the messages already received
+            size_t consumed;
+            try {
+                consumed = connection.decoder.decode(
+                    connection.input.data(), entry.input_len, frames_left,
+                    [&](std::vector<uint8_t>&& message) {
+                        frames_left--;
+                        NIX_TCP_PROBE(message, entry.fd, message.size());
+                        TcpMetrics::add(TcpMetrics::messages_received);
+                        connection.stats.messages_received++;
+                        if (this->capture != nullptr) {
+                            this->record(id, TcpCapture::received,
+                                         message.data(), message.size());
+                        }
+                        if (entry.closed) {
+                            return;
+                        }
+                        if (this->request_handler) {
+                            this->handle(id, std::move(message));
+                        } else if (this->handler) {
+                            this->handler(*this, id, std::move(message));
+                        }
+                    });
+            } catch (TcpError&) {
+                this->close(id);
+                return false;
+            }
+            if (consumed > 0) {
+                std::memmove(connection.input.data(),
+                             connection.input.data() + consumed,
+                             entry.input_len - consumed);
+                entry.input_len -= consumed;
+            }
+
+            if (entry.closed || drained) {
+                return false;
+            }
+            if (frames_left == 0 || entry.deficit == 0) {
+                return true;
+            }
+
+            // Read more, within the byte budget
+            if (connection.input.size() < input_capacity) {
+                connection.input = this->buffers.acquire();
+                connection.input.resize(input_capacity);
+            }
+            auto want = std::min(entry.deficit,
+                                 input_capacity - entry.input_len);
+            auto received = ::recv(entry.fd,
+                                   connection.input.data() + entry.input_len,
+                                   want, MSG_DONTWAIT);
+            TcpMetrics::add(TcpMetrics::syscalls);
+            if (received == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                }
+                this->close(id);
+                return false;
+            } else if (received == 0) {
+                this->close(id);
+                return false;
+            }
+
+            TcpMetrics::add(TcpMetrics::bytes_received, received);
+            connection.stats.bytes_received += received;
+            this->bytes_moved.store(this->bytes_moved + received,
+                                    std::memory_order_relaxed);
+            entry.input_len += received;
+            entry.deficit -= received;
+            // A short read means the socket has nothing left for now
+            drained = (size_t)received < want;
+        }
+    }
+
+    // Give every connection waiting in the round robin its turn
+    void round() {
+        auto count = this->ready.size();
+        for (size_t i = 0; i < count; i++) {
+            auto id = this->ready.front();
+            this->ready.pop_front();
+
+            auto entry = this->find(id);
+            if (entry == nullptr) {
+                continue;
+            }
+
+            entry->deficit += this->quantum;
+            auto busy = this->service(id) && !entry->closed;
+
+            // Once every received byte is handled the buffer can serve other
+            // connections
+            auto& connection = this->cold[slot_of(id)];
+            if (entry->input_len == 0 && !connection.input.empty()) {
+                this->buffers.release(std::move(connection.input));
+            }
+
+            if (busy) {
+                this->ready.push_back(id);
+            } else {
+                // Idle connections don't accumulate budget
+                entry->active = false;
+                entry->deficit = 0;
+            }
+        }
+    }
+
+    // Close the socket of a slot, leaving it as found
+    void release(uint32_t slot) {
+        auto& entry = this->hot[slot];
+        auto& connection = this->cold[slot];
+        if (this->tuner != nullptr) {
+            this->tuner->release(entry.fd);
+        }
+        ::close(entry.fd);
+        TcpMetrics::add(TcpMetrics::connections_closed);
+        TcpMetrics::adjust(TcpMetrics::pending_output_bytes,
+                           -(int64_t)(connection.output.size() -
+                                      entry.output_offset));
+    }
+
+    // Make a slot available for reuse, invalidating the handles to it
+    void free(uint32_t slot) {
+        auto& entry = this->hot[slot];
+        auto generation = entry.generation + 1;
+        entry = Hot{-1, generation == 0 ? 1 : generation, 0, 0, 0, false,
+                    false, false, false};
+        auto& connection = this->cold[slot];
+        connection.decoder =
+            TcpPacketDecoder(this->packet_len, this->max_message);
+        this->buffers.release(std::move(connection.input));
+        this->buffers.release(std::move(connection.output));
+        this->free_slots.push_back(slot);
+        this->used--;
+    }
+
+    // Hand the connections migrating during the iteration over to their new
+    // servers, between two messages
+    void emigrate() {
+        auto leaving = std::move(this->leaving);
+        this->leaving.clear();
+        for (auto& departure : leaving) {
+            auto id = departure.first;
+            auto entry = this->find(id);
+            if (entry == nullptr) {
+                continue;
+            }
+
+            auto slot = slot_of(id);
+            auto& connection = this->cold[slot];
+            auto migration = new Migration{
+                id,
+                std::move(connection.decoder),
+                std::move(connection.input),
+                entry->input_len,
+                std::move(connection.output),
+                entry->output_offset,
+                connection.stats,
+                connection.capture_id,
+            };
+
+            Handoff handoff;
+            handoff.fd = entry->fd;
+            handoff.address = connection.address;
+            handoff.address_len = connection.address_len;
+            handoff.migration = migration;
+
+            // Stay put if the new server has too much on its plate already
+            auto target = departure.second;
+            target->handoffs++;
+            if (!target->inbox.push(handoff)) {
+                target->handoffs--;
+                connection.decoder = std::move(migration->decoder);
+                connection.input = std::move(migration->input);
+                connection.output = std::move(migration->output);
+                delete migration;
+                continue;
+            }
+
+            epoll_ctl(this->epollfd, EPOLL_CTL_DEL, entry->fd, nullptr);
+            NIX_TCP_PROBE(migrate, entry->fd, id);
+            this->free(slot);
+            target->wake();
+        }
+    }
+
+    // Tear down the connections closed during the iteration
+    void reap() {
+        auto closing = std::move(this->closing);
+        this->closing.clear();
+        for (auto id : closing) {
+            auto slot = slot_of(id);
+            this->release(slot);
+            this->free(slot);
+
+            if (this->close_handler) {
+                this->close_handler(*this, id);
+            }
+        }
+    }
+
+  public:
+    TcpServer(uint8_t packet_len) : inbox(1024) {
+        this->listenfd = std::nullopt;
+        this->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (this->epollfd == -1) {
+            struct TcpError error = {errno, "couldn't create event loop"};
+            throw error;
+        }
+
+        this->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof event);
+        event.events = EPOLLIN;
+        event.data.u64 = wakeup;
+        if (this->wakefd == -1 ||
+            epoll_ctl(this->epollfd, EPOLL_CTL_ADD, this->wakefd, &event) ==
+                -1) {
+            struct TcpError error = {errno, "couldn't create wakeup event"};
+            if (this->wakefd != -1) {
+                ::close(this->wakefd);
+            }
+            ::close(this->epollfd);
+            throw error;
+        }
+
+        this->packet_len = packet_len;
+        this->max_message = TcpPacketDecoder::default_max_message;
+        this->handoffs = 0;
+        this->bytes_moved = 0;
+
+        this->used = 0;
+        this->output_high = 0;
+        this->quantum = 1 << 16;
+        this->frames = 64;
+        this->stopped = false;
+        this->tuner = nullptr;
+        this->capture = nullptr;
+    }
+    TcpServer() : TcpServer(64) {}
+    TcpServer(TcpServer const&) = delete;
+    TcpServer& operator=(TcpServer const&) = delete;
+
+    // Close every socket on drop
+    ~TcpServer() {
+        for (uint32_t slot = 0; slot < this->hot.size(); slot++) {
+            if (this->hot[slot].used) {
+                this->release(slot);
+            }
+        }
+        Handoff handoff;
+        while (this->inbox.pop(handoff)) {
+            ::close(handoff.fd);
+            delete handoff.migration;
+        }
+        if (this->listenfd.has_value()) {
+            ::close(*this->listenfd);
+        }
+        ::close(this->wakefd);
+        ::close(this->epollfd);
+    }
+
+    // Binds the server to the specified port and starts listening, sharing
+    // the port with other sockets bound with "reuse_port" set if it is
+    void bind(std::string const& port, bool reuse_port) {
+        if (this->listenfd.has_value()) {
+            struct TcpError error = {-1, "server already bound"};
+            throw error;
+        }
+
+        struct addrinfo hints;
+        std::memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        struct addrinfo* server_info;
+        auto gai_ret = getaddrinfo(nullptr, port.c_str(), &hints, &server_info);
+        if (gai_ret != 0) {
+            struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
+            throw error;
+        }
+
+        // Loop through the list to find a valid IP address to bind to
+        struct addrinfo* i;
+        int fd = -1;
+        for (i = server_info; i != nullptr; i = i->ai_next) {
+            fd = socket(i->ai_family,
+                        i->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        i->ai_protocol);
+            if (fd == -1) {
+                continue;
+            }
+
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+            if (reuse_port) {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes);
+            }
+
+            if (::bind(fd, i->ai_addr, i->ai_addrlen) == -1 ||
+                listen(fd, SOMAXCONN) == -1) {
+                ::close(fd);
+                continue;
+            }
+
+            break;
+        }
+
+        freeaddrinfo(server_info);
+
+        if (i == nullptr) {
+            struct TcpError error = {1, "couldn't bind to any address"};
+            throw error;
+        }
+
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof event);
+        event.events = EPOLLIN;
+        event.data.u64 = listener;
+        if (epoll_ctl(this->epollfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            struct TcpError error = {errno, "couldn't watch listening socket"};
+            ::close(fd);
+            throw error;
+        }
+
+        this->listenfd = fd;
+    }
+    void bind(std::string const& port) { this->bind(port, false); }
+
+    // Set the handler called with every message received
+    void on_message(Handler handler) { this->handler = std::move(handler); }
+    // Set the handler called with every message received instead, with an
+    // arena that is reset once it returns
+    //
+    // Whatever the handler builds from the message, its answer included,
+    // can be allocated from the arena, since "send" is done with the answer
+    // by the time it returns. Nothing allocated from it may be kept around
+    void on_request(RequestHandler handler) {
+        this->request_handler = std::move(handler);
+    }
+    // Set the handler called when a connection is closed
+    void on_close(CloseHandler handler) {
+        this->close_handler = std::move(handler);
+    }
+    // Set the handler called when a connection migrates to this server
+    void on_migrate(MigrateHandler handler) {
+        this->migrate_handler = std::move(handler);
+    }
+
+    // Set how many bytes and messages each busy connection may handle every
+    // time it is serviced
+    void set_budget(size_t bytes, size_t messages) {
+        this->quantum = std::max(bytes, (size_t)this->packet_len);
+        this->frames = std::max(messages, (size_t)1);
+    }
+
+    // Close connections sending messages larger than "bytes", announced or
+    // not, messages being limited to 1 GiB by default
+    //
+    // Only applies to connections accepted afterwards
+    void set_max_message(size_t bytes) { this->max_message = bytes; }
+
+    // Number of open connections
+    size_t size() { return this->used - this->closing.size(); }
+
+    // Memory held by the server for its connections, in bytes: their slots,
+    // the buffers lent to them and the spare ones
+    size_t memory() {
+        auto total = this->hot.capacity() * sizeof(Hot) +
+                     this->cold.capacity() * sizeof(Cold) +
+                     this->free_slots.capacity() * sizeof(uint32_t) +
+                     this->buffers.memory() + this->arenas.memory();
+        for (auto& connection : this->cold) {
+            total += connection.decoder.memory() +
+                     connection.input.capacity() +
+                     connection.output.capacity();
+        }
+        return total;
+    }
+
+    // Traffic of a connection, nothing if the connection is closed
+    std::optional<Stats> stats(TcpConnection id) {
+        if (this->find(id) == nullptr) {
+            return std::nullopt;
+        }
+        return this->cold[slot_of(id)].stats;
+    }
+
+    // Numeric address and port of the peer of a connection, nothing if the
+    // connection is closed
+    std::optional<std::string> address(TcpConnection id) {
+        if (this->find(id) == nullptr) {
+            return std::nullopt;
+        }
+        auto& data = this->cold[slot_of(id)];
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        if (getnameinfo((struct sockaddr*)&data.address, data.address_len,
+                        host, sizeof host, port, sizeof port,
+                        NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            return std::nullopt;
+        }
+        return std::string(host) + ":" + port;
+    }
+
+    // Cap the rate at which the kernel sends data on a connection, in bytes
+    // per second, returns false if the connection is closed
+    bool set_pacing_rate(TcpConnection id, uint64_t rate) {
+        auto entry = this->find(id);
+        if (entry == nullptr) {
+            return false;
+        }
+        TcpSocketOptions::set_pacing_rate(entry->fd, rate);
+        return true;
+    }
+
+    // Resize the kernel buffers of every connection after their
+    // bandwidth-delay product, meant to be called periodically
+    void autotune(TcpBufferTuner& tuner) {
+        this->tuner = &tuner;
+        for (uint32_t slot = 0; slot < this->hot.size(); slot++) {
+            auto& entry = this->hot[slot];
+            if (entry.used && !entry.closed) {
+                try {
+                    tuner.tune(entry.fd);
+                } catch (TcpError&) {
+                    this->close(this->handle(slot));
+                }
+            }
+        }
+    }
+
+    // Record every message sent and received from now on to "capture",
+    // which must outlive the server or "stop_recording" being called
+    //
+    // Each connection gets an identifier of its own in the capture
+    void record(TcpCapture& capture) { this->capture = &capture; }
+    void stop_recording() { this->capture = nullptr; }
+
+    // Select the congestion control algorithm of a connection, returns false
+    // if the connection is closed
+    bool set_congestion_control(TcpConnection id, std::string const& name) {
+        auto entry = this->find(id);
+        if (entry == nullptr) {
+            return false;
+        }
+        TcpSocketOptions::set_congestion_control(entry->fd, name);
+        return true;
+    }
+
+    // Send a message on a connection, returns false if the connection is
+    // closed
+    //
+    // Whatever the socket doesn't take right away is written as it becomes
+    // writable again
+    bool send(TcpConnection id, std::vector<uint8_t> const& data) {
+        return this->send(id, data.data(), data.size());
+    }
+    bool send(TcpConnection id, std::pmr::vector<uint8_t> const& data) {
+        return this->send(id, data.data(), data.size());
+    }
+    bool send(TcpConnection id, uint8_t const* data, size_t size) {
+        auto entry = this->find(id);
+        if (entry == nullptr) {
+            return false;
+        }
+        auto& connection = this->cold[slot_of(id)];
+        if (connection.output.capacity() == 0) {
+            connection.output = this->buffers.acquire();
+            connection.output.clear();
+        }
+
+        auto len = connection.output.size();
+        connection.output.resize(
+            len + TcpPacketEncoder::packets(this->packet_len, size) *
+                      this->packet_len);
+        size_t offset = 0;
+        TcpPacketEncoder::encode(this->packet_len, data, size, offset,
+                                 SIZE_MAX, connection.output.data() + len);
+
+        NIX_TCP_PROBE(send, entry->fd, size);
+        if (this->capture != nullptr) {
+            this->record(id, TcpCapture::sent, data, size);
+        }
+        TcpMetrics::add(TcpMetrics::messages_sent);
+        TcpMetrics::adjust(TcpMetrics::pending_output_bytes,
+                           connection.output.size() - len);
+        connection.stats.messages_sent++;
+        if (connection.output.size() > this->output_high) {
+            this->output_high = connection.output.size();
+            NIX_TCP_PROBE(output__high, entry->fd, this->output_high);
+        }
+
+        if (!entry->writing) {
+            this->flush(id);
+        }
+        return true;
+    }
+
+    // Close a connection, once the current iteration is over
+    void close(TcpConnection id) {
+        auto entry = this->find(id);
+        if (entry == nullptr) {
+            return;
+        }
+
+        entry->closed = true;
+        this->closing.push_back(id);
+    }
+
+    // Wait up to "timeout" milliseconds (forever if negative) for events and
+    // handle them
+    void run_once(int timeout) {
+        struct epoll_event events[64];
+        auto count = epoll_wait(this->epollfd, events, 64,
+                                this->ready.empty() ? timeout : 0);
+        if (count == -1) {
+            if (errno != EINTR) {
+                struct TcpError error = {errno, "couldn't wait for events"};
+                throw error;
+            }
+            count = 0;
+        }
+
+        for (auto i = 0; i < count; i++) {
+            auto id = (TcpConnection)events[i].data.u64;
+            if (id == listener) {
+                this->accept_all();
+                continue;
+            } else if (id == wakeup) {
+                this->adopt_all();
+                continue;
+            }
+
+            // Events of a connection closed earlier in the batch carry a
+            // stale handle
+            auto entry = this->find(id);
+            if (entry == nullptr) {
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                this->flush(id);
+            }
+            auto readable = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+            if ((events[i].events & readable) && !entry->active &&
+                !entry->closed) {
+                entry->active = true;
+                this->ready.push_back(id);
+            }
+        }
+
+        this->round();
+        this->emigrate();
+        this->reap();
+    }
+
+    // Run the event loop until "stop" is called
+    void run() {
+        this->stopped = false;
+        while (!this->stopped) {
+            this->run_once(-1);
+        }
+    }
+
+    // Make "run" return after the current iteration, from a handler or any
+    // other thread
+    void stop() {
+        this->stopped = true;
+        this->wake();
+    }
+
+    // Make the current or next wait for events return right away, from any
+    // thread
+    void wake() {
+        uint64_t one = 1;
+        auto written = ::write(this->wakefd, &one, sizeof one);
+        (void)written;
+    }
+
+    // Hand a connected non-blocking socket over to the server, from any
+    // thread, returns false if too many are on their way already
+    //
+    // The server takes ownership of the socket once accepted
+    bool adopt(int fd, struct sockaddr const* address,
+               socklen_t address_len) {
+        Handoff handoff;
+        handoff.fd = fd;
+        handoff.address_len =
+            std::min(address_len, (socklen_t)sizeof handoff.address);
+        std::memcpy(&handoff.address, address, handoff.address_len);
+        handoff.migration = nullptr;
+
+        // Counted first so that the load never misses it
+        this->handoffs++;
+        if (!this->inbox.push(handoff)) {
+            this->handoffs--;
+            return false;
+        }
+        this->wake();
+        return true;
+    }
+
+    // Number of connections served or on their way, from any thread
+    size_t load() { return this->used + this->handoffs; }
+
+    // Bytes received and sent over all connections so far, from any thread
+    uint64_t work() { return this->bytes_moved; }
+
+    // Move a connection to another server, once the current iteration is
+    // over, returns false if the connection is closed
+    //
+    // The connection keeps its socket, buffers and partly received message
+    // but gets a new handle on the other server, which must run its loop.
+    // Must be called from the thread running this server
+    bool migrate(TcpConnection id, TcpServer& target) {
+        if (this->find(id) == nullptr || &target == this) {
+            return false;
+        }
+        this->leaving.emplace_back(id, &target);
+        return true;
+    }
+
+    // Connections ranked by the bytes they moved since the last call, the
+    // busiest first
+    std::vector<std::pair<TcpConnection, uint64_t>> busiest() {
+        std::vector<std::pair<TcpConnection, uint64_t>> ranking;
+        for (uint32_t slot = 0; slot < this->hot.size(); slot++) {
+            if (!this->hot[slot].used || this->hot[slot].closed) {
+                continue;
+            }
+            auto& connection = this->cold[slot];
+            auto total =
+                connection.stats.bytes_received + connection.stats.bytes_sent;
+            ranking.emplace_back(this->handle(slot), total - connection.mark);
+            connection.mark = total;
+        }
+        std::sort(ranking.begin(), ranking.end(),
+                  [](auto const& a, auto const& b) {
+                      return a.second > b.second;
+                  });
+        return ranking;
+    }
 };
 
-// Wrapper around a *nix TCP socket
-class TcpSocket {
-    // Local socket file descriptor
-    std::optional<int> sockfd;
-    // Remote socket file descriptor
-    std::optional<int> remote_sockfd;
+// Runs one server per CPU, each on a thread pinned to its CPU with a listening
+// socket of its own on the shared port
+//
+// The listening sockets form a SO_REUSEPORT group. Unless told otherwise, a
+// classic BPF program attached to the group hands every new connection to the
+// socket of the server running on the CPU that received the connection
+// request, so that the whole life of a connection is spent on a single core.
+// Handlers run on the thread of their server and must be safe to call
+// concurrently with the handlers of the other servers
+class TcpServerGroup {
+    std::vector<std::unique_ptr<TcpServer>> servers;
+    // CPU each server runs on
+    std::vector<int> cpus;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping;
 
-    // Packet length
-    uint8_t packet_len;
+    // Time between two load comparisons, zero if connections stay where
+    // they were accepted
+    std::chrono::milliseconds balance_interval;
+    // How many times busier than the least busy server a server must be to
+    // give connections away
+    double balance_threshold;
+    // Bytes each server moved over its last interval
+    std::unique_ptr<std::atomic<uint64_t>[]> recent;
 
-    static void* get_in_addr(struct sockaddr* sa) {
-        return sa->sa_family == AF_INET
-                   ? (void*)&(((struct sockaddr_in*)sa)->sin_addr)
-                   : (void*)&(((struct sockaddr_in6*)sa)->sin6_addr);
+    // Least busy servers below this many bytes per interval are left alone,
+    // their load being mostly noise
+    static constexpr uint64_t balance_floor = 1 << 16;
+
+    // Move some of the busiest connections of server "i" to the least busy
+    // server if it is too busy in comparison, from the thread of server "i"
+    void balance(size_t i) {
+        auto& server = *this->servers[i];
+        // Ranked every time so that activity is counted per interval
+        auto ranking = server.busiest();
+
+        size_t idle = 0;
+        for (size_t j = 0; j < this->servers.size(); j++) {
+            if (this->recent[j] < this->recent[idle]) {
+                idle = j;
+            }
+        }
+        uint64_t load = this->recent[i];
+        uint64_t lowest = this->recent[idle];
+        if (idle == i || load < balance_floor ||
+            load < this->balance_threshold * lowest) {
+            return;
+        }
+
+        // Even out the two servers, a connection busier than what is left
+        // to move would only swap their roles
+        auto excess = (load - lowest) / 2;
+        uint64_t moved = 0;
+        for (auto& entry : ranking) {
+            if (moved >= excess || entry.second == 0) {
+                break;
+            }
+            if (entry.second > excess - moved) {
+                continue;
+            }
+            if (server.migrate(entry.first, *this->servers[idle])) {
+                moved += entry.second;
+            }
+        }
+
+        // Account for the move right away so that other servers don't pile
+        // onto the same target before the next interval
+        this->recent[i] -= moved;
+        this->recent[idle] += moved;
+    }
+
+    // Program returning the index of the server running on the current CPU,
+    // falling back to the CPU number modulo the number of servers
+    std::vector<struct sock_filter> steering_program() {
+        std::vector<struct sock_filter> program;
+        program.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                   (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+        for (size_t i = 0; i < this->cpus.size(); i++) {
+            program.push_back(
+                BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)this->cpus[i],
+                         0, 1));
+            program.push_back(BPF_STMT(BPF_RET | BPF_K, (uint32_t)i));
+        }
+        program.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,
+                                   (uint32_t)this->cpus.size()));
+        program.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+        return program;
     }
 
   public:
-    TcpSocket(uint8_t packet_len) {
-        this->sockfd = std::nullopt;
-        this->remote_sockfd = std::nullopt;
+    // Create "count" servers, or one per CPU the process may run on if 0
+    //
+    // Servers are spread over the CPUs in turn, when steering only the first
+    // server on each CPU gets connections
+    TcpServerGroup(uint8_t packet_len, size_t count) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof set, &set) == -1) {
+            struct TcpError error = {errno, "couldn't get CPU affinity"};
+            throw error;
+        }
+        std::vector<int> allowed;
+        for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                allowed.push_back(cpu);
+            }
+        }
+        if (count == 0) {
+            count = allowed.size();
+        }
 
-        this->packet_len = packet_len;
+        this->recent.reset(new std::atomic<uint64_t>[count]);
+        for (size_t i = 0; i < count; i++) {
+            this->servers.emplace_back(new TcpServer(packet_len));
+            this->cpus.push_back(allowed[i % allowed.size()]);
+            this->recent[i] = 0;
+        }
+        this->stopping = false;
+        this->balance_interval = std::chrono::milliseconds(0);
+        this->balance_threshold = 0;
     }
-    TcpSocket() : TcpSocket(64) {}
+    TcpServerGroup(uint8_t packet_len) : TcpServerGroup(packet_len, 0) {}
+    TcpServerGroup() : TcpServerGroup(64) {}
+    TcpServerGroup(TcpServerGroup const&) = delete;
+    TcpServerGroup& operator=(TcpServerGroup const&) = delete;
 
-    // Close the sockets on drop
-    ~TcpSocket() {
-        if (this->is_connected()) {
-            close(*this->remote_sockfd);
+    ~TcpServerGroup() { this->stop(); }
+
+    // Number of servers
+    size_t size() { return this->servers.size(); }
+    // Server of index "i", to set up before starting the group
+    TcpServer& server(size_t i) { return *this->servers[i]; }
+    // CPU the server of index "i" runs on
+    int cpu(size_t i) { return this->cpus[i]; }
+
+    // Set the handler called with every message received, on every server
+    void on_message(TcpServer::Handler handler) {
+        for (auto& server : this->servers) {
+            server->on_message(handler);
         }
-        if (this->is_bound()) {
-            close(*this->sockfd);
+    }
+    // Set the handler called with every message received along with an
+    // arena, on every server
+    void on_request(TcpServer::RequestHandler handler) {
+        for (auto& server : this->servers) {
+            server->on_request(handler);
+        }
+    }
+    // Set the handler called when a connection is closed, on every server
+    void on_close(TcpServer::CloseHandler handler) {
+        for (auto& server : this->servers) {
+            server->on_close(handler);
+        }
+    }
+    // Set the handler called when a connection migrates, on every server
+    void on_migrate(TcpServer::MigrateHandler handler) {
+        for (auto& server : this->servers) {
+            server->on_migrate(handler);
         }
     }
 
-    // Whether the socket is currently bound to a port
-    bool is_bound() { return this->sockfd.has_value(); }
-    // Whether the socket is currently connected to a remote socket
-    bool is_connected() { return this->remote_sockfd.has_value(); }
+    // Compare the load of the servers every "interval" once started, and
+    // have any server "threshold" times busier than the least busy one
+    // migrate some of its busiest connections there
+    //
+    // Load is measured in bytes received and sent. Connections move at
+    // message boundaries with whatever they have buffered, and get new
+    // handles on their new server
+    void set_rebalancing(std::chrono::milliseconds interval,
+                         double threshold) {
+        this->balance_interval = interval;
+        this->balance_threshold = std::max(threshold, 1.0);
+    }
 
-    // Binds the socket to the specified port
-    void bind(std::string const& port) {
-        if (this->is_bound()) {
-            struct TcpError error = {-1, "socket already bound"};
-            throw error;
+    // Bind every server to the specified port and start listening, steering
+    // connections to the server on the CPU they arrive on if "steer" is set
+    void bind(std::string const& port, bool steer) {
+        // The sockets join the group in order, which is the index the
+        // steering program returns
+        for (auto& server : this->servers) {
+            server->bind(port, true);
         }
 
-        // Basic information about the socket needed to find a suitable address
-        // to bind to
-        struct addrinfo hints;
-        std::memset(&hints, 0, sizeof hints);
-        // IPV4 or IPV6 (read "AF_UNSPEC" as "address family : unspecified")
-        hints.ai_family = AF_UNSPEC;
-        // TCP (for UDP sockets this would be "SOCK_DATAGRAM")
-        hints.ai_socktype = SOCK_STREAM;
-        // Choose an IP for us
-        hints.ai_flags = AI_PASSIVE;
+        if (steer) {
+            auto program = this->steering_program();
+            struct sock_fprog fprog;
+            fprog.len = program.size();
+            fprog.filter = program.data();
+            if (setsockopt(*this->servers[0]->listenfd, SOL_SOCKET,
+                           SO_ATTACH_REUSEPORT_CBPF, &fprog,
+                           sizeof fprog) == -1) {
+                struct TcpError error = {errno,
+                                         "couldn't attach steering program"};
+                throw error;
+            }
+        }
+    }
+    void bind(std::string const& port) { this->bind(port, true); }
 
-        // Obtain a linked-list of IP addresses that fit the criteria
-        struct addrinfo* server_info;
-        auto gai_ret = getaddrinfo(nullptr, port.c_str(), &hints, &server_info);
-        if (gai_ret != 0) {
-            struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
+    // Run every server on its own pinned thread until "stop" is called
+    void start() {
+        if (!this->threads.empty()) {
+            struct TcpError error = {-1, "server group already started"};
             throw error;
         }
 
-        // Loop through the list to find a valid IP address to bind to
-        struct addrinfo* i;
-        for (i = server_info; i != nullptr; i = i->ai_next) {
-            // Create a new socket
-            this->sockfd = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
-            if (this->sockfd == -1) {
-                continue;
-            }
+        this->stopping = false;
+        for (size_t i = 0; i < this->servers.size(); i++) {
+            this->threads.emplace_back([this, i] {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(this->cpus[i], &set);
+                pthread_setaffinity_np(pthread_self(), sizeof set, &set);
 
-            // Avoid errors when another socket recently stopped listening on
-            // the same port
-            int yes = 1;
-            if (setsockopt(*this->sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
-                           sizeof yes) == -1) {
-                struct TcpError error = {errno, "couldn't set socket options"};
-                throw error;
-            }
+                auto& server = *this->servers[i];
+                auto interval = this->balance_interval;
+                if (interval.count() == 0) {
+                    while (!this->stopping) {
+                        server.run_once(-1);
+                    }
+                    return;
+                }
 
-            // Bind the socket
-            if (::bind(*this->sockfd, i->ai_addr, i->ai_addrlen) == -1) {
-                close(*this->sockfd);
-                continue;
-            }
+                auto last_work = server.work();
+                auto next_balance = std::chrono::steady_clock::now() + interval;
+                while (!this->stopping) {
+                    auto now = std::chrono::steady_clock::now();
+                    if (now >= next_balance) {
+                        auto work = server.work();
+                        this->recent[i] = work - last_work;
+                        last_work = work;
+                        this->balance(i);
+                        next_balance = now + interval;
+                    }
 
-            break;
+                    auto wait =
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            next_balance - now);
+                    server.run_once(std::max((int)wait.count(), 1));
+                }
+            });
         }
+    }
 
-        // Not calling this would leak the memory used by the list
-        freeaddrinfo(server_info);
+    // Stop the servers and wait for their threads to return
+    void stop() {
+        this->stopping = true;
+        for (auto& server : this->servers) {
+            server->wake();
+        }
+        for (auto& thread : this->threads) {
+            thread.join();
+        }
+        this->threads.clear();
+    }
+};
 
-        // If "i" is still null here, that means no suitable IP addresses were
-        // found
-        if (i == nullptr) {
-            this->sockfd = std::nullopt;
+// Accepts connections on threads of its own and hands them over to servers
+// running their event loops elsewhere
+//
+// Bursts of new connections then only cost the servers a wakeup and the
+// registration of each socket, the accept calls themselves being made on the
+// acceptor threads, which take whatever pending connections there are at
+// once. The servers aren't bound themselves, they must be running for the
+// connections to be served
+class TcpAcceptor {
+  public:
+    // How connections are spread over the servers
+    enum Policy {
+        // Each server in turn
+        round_robin,
+        // Server with the fewest connections
+        least_loaded,
+    };
 
-            struct TcpError error = {1, "couldn't bind to any address"};
-            throw error;
+  private:
+    std::vector<TcpServer*> servers;
+    Policy policy;
+
+    std::optional<int> listenfd;
+    // Event the threads are stopped with
+    int stopfd;
+    std::vector<std::thread> threads;
+
+    std::atomic<size_t> next;
+    std::atomic<uint64_t> accepted_count;
+
+    // Most connections accepted in a row before checking for a stop
+    static constexpr size_t batch = 64;
+    // Most times every server is offered a connection, a millisecond apart,
+    // before it is dropped
+    static constexpr size_t handoff_rounds = 100;
+
+    TcpServer& pick() {
+        if (this->policy == round_robin) {
+            return *this->servers[this->next++ % this->servers.size()];
         }
-    }
 
-    // Listen for connections and accept the first incoming one
-    void accept() {
-        if (!this->is_bound()) {
-            struct TcpError error = {-2, "socket unbound"};
-            throw error;
+        auto best = this->servers[0];
+        auto best_load = best->load();
+        for (auto server : this->servers) {
+            auto load = server->load();
+            if (load < best_load) {
+                best = server;
+                best_load = load;
+            }
         }
-        if (this->is_connected()) {
-            struct TcpError error = {-1, "socket already connected"};
-            throw error;
+        return *best;
+    }
+
+    // Hand a connection over to a server, giving them some time to make room
+    // if they are all too far behind, returns false if none did or the
+    // acceptor is stopping
+    bool hand_over(int fd, struct sockaddr const* address,
+                   socklen_t address_len) {
+        if (this->pick().adopt(fd, address, address_len)) {
+            return true;
         }
+        for (size_t round = 0; round < handoff_rounds; round++) {
+            for (auto server : this->servers) {
+                if (server->adopt(fd, address, address_len)) {
+                    return true;
+                }
+            }
 
-        // Start listening
-        if (listen(*this->sockfd, 1) == -1) {
-            struct TcpError error = {errno, "couldn't listen for connections"};
-            throw error;
+            struct pollfd stop = {this->stopfd, POLLIN, 0};
+            if (poll(&stop, 1, 1) > 0) {
+                return false;
+            }
         }
+        return false;
+    }
 
-        // Loop until a connection is successfully accepted
-        struct sockaddr_storage remote_addr;
-        socklen_t sin_len = sizeof remote_addr;
+    void run() {
         while (true) {
-            // Accept a connection
-            this->remote_sockfd = ::accept(
-                *this->sockfd, (struct sockaddr*)&remote_addr, &sin_len);
+            struct pollfd fds[2];
+            fds[0] = {*this->listenfd, POLLIN, 0};
+            fds[1] = {this->stopfd, POLLIN, 0};
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents != 0) {
+                return;
+            }
 
-            if (this->remote_sockfd != -1) {
-                break;
+            for (size_t i = 0; i < batch; i++) {
+                struct sockaddr_storage address;
+                socklen_t address_len = sizeof address;
+                auto fd = accept4(*this->listenfd, (struct sockaddr*)&address,
+                                  &address_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+
+                NIX_TCP_PROBE(accept, *this->listenfd, fd);
+                TcpMetrics::add(TcpMetrics::connections_opened);
+                this->accepted_count++;
+
+                // Servers too far behind push back on the acceptor: the
+                // connection none of them took is dropped, and the next ones
+                // are left in the backlog until the next poll
+                if (!this->hand_over(fd, (struct sockaddr*)&address,
+                                     address_len)) {
+                    NIX_TCP_PROBE(drop, *this->listenfd, fd);
+                    ::close(fd);
+                    TcpMetrics::add(TcpMetrics::connections_closed);
+                    break;
+                }
             }
         }
     }
 
-    void connect(std::string const& remote, std::string const& port) {
-        if (!this->is_bound()) {
-            struct TcpError error = {-2, "socket unbound"};
+  public:
+    TcpAcceptor(std::vector<TcpServer*> servers, Policy policy) {
+        if (servers.empty()) {
+            struct TcpError error = {-1, "no server to accept for"};
             throw error;
         }
-        if (this->is_connected()) {
-            struct TcpError error = {-1, "socket already connected"};
+        this->servers = std::move(servers);
+        this->policy = policy;
+        this->listenfd = std::nullopt;
+        this->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->stopfd == -1) {
+            struct TcpError error = {errno, "couldn't create stop event"};
+            throw error;
+        }
+        this->next = 0;
+        this->accepted_count = 0;
+    }
+    TcpAcceptor(std::vector<TcpServer*> servers)
+        : TcpAcceptor(std::move(servers), least_loaded) {}
+    TcpAcceptor(TcpAcceptor const&) = delete;
+    TcpAcceptor& operator=(TcpAcceptor const&) = delete;
+
+    ~TcpAcceptor() {
+        this->stop();
+        if (this->listenfd.has_value()) {
+            ::close(*this->listenfd);
+        }
+        ::close(this->stopfd);
+    }
+
+    // Binds the acceptor to the specified port and starts listening
+    void bind(std::string const& port) {
+        if (this->listenfd.has_value()) {
+            struct TcpError error = {-1, "acceptor already bound"};
             throw error;
         }
 
-        // Basic information about the remote
         struct addrinfo hints;
         std::memset(&hints, 0, sizeof hints);
         hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
 
-        // Obtain a linked-list of IP addresses that fit the criteria
         struct addrinfo* server_info;
-        auto gai_ret =
-            getaddrinfo(remote.c_str(), port.c_str(), &hints, &server_info);
+        auto gai_ret = getaddrinfo(nullptr, port.c_str(), &hints, &server_info);
         if (gai_ret != 0) {
             struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
             throw error;
         }
 
-        // Loop through the list to find a valid IP address to connect to
+        // Loop through the list to find a valid IP address to bind to
         struct addrinfo* i;
+        int fd = -1;
         for (i = server_info; i != nullptr; i = i->ai_next) {
-            // Create a new remote socket
-            this->remote_sockfd =
-                socket(i->ai_family, i->ai_socktype, i->ai_protocol);
-            if (this->remote_sockfd == -1) {
+            fd = socket(i->ai_family,
+                        i->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        i->ai_protocol);
+            if (fd == -1) {
                 continue;
             }
 
-            // Bind the socket
-            if (::connect(*this->remote_sockfd, i->ai_addr, i->ai_addrlen) ==
-                -1) {
-                close(*this->remote_sockfd);
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+
+            if (::bind(fd, i->ai_addr, i->ai_addrlen) == -1 ||
+                listen(fd, SOMAXCONN) == -1) {
+                ::close(fd);
                 continue;
             }
 
             break;
         }
 
-        // If "i" is still null here, that means no suitable IP addresses were
-        // found
-        if (i == nullptr) {
-            this->remote_sockfd = std::nullopt;
+        freeaddrinfo(server_info);
 
-            struct TcpError error = {1, "couldn't connect to any address"};
+        if (i == nullptr) {
+            struct TcpError error = {1, "couldn't bind to any address"};
             throw error;
         }
 
-        // Not calling this would leak the memory used by the list
-        freeaddrinfo(server_info);
+        this->listenfd = fd;
     }
 
-    // Send data
-    void send(std::vector<uint8_t> const& data) {
-        if (!this->is_bound()) {
-            struct TcpError error = {-2, "socket unbound"};
+    // Accept connections on "count" threads until "stop" is called
+    void start(size_t count) {
+        if (!this->listenfd.has_value()) {
+            struct TcpError error = {-2, "acceptor unbound"};
             throw error;
         }
-        if (!this->is_connected()) {
-            struct TcpError error = {-2, "socket disconnected"};
+        if (!this->threads.empty()) {
+            struct TcpError error = {-1, "acceptor already started"};
             throw error;
         }
 
-        std::vector<uint8_t> packet(this->packet_len, 0);
-
-        // Loop through the data by chunks
-        auto data_size = data.size();
-        auto offset = 0;
-        uint8_t count;
-        auto i = 0;
-        for (; offset < data_size; offset += count) {
-            // Grab a chunk of data
-            count = std::min((unsigned long)this->packet_len - 1,
-                             data_size - offset);
-
-            // Write the chunk length at the beginning of the packet
-            packet[0] = count;
-            // Fill the rest of the packet with the chunk
-            for (i = 1; i <= count; i++) {
-                packet[i] = data[i - 1 + offset];
-            }
-
-            // Send the packet
-            if (::send(*this->remote_sockfd, packet.data(), this->packet_len,
-                       0) == -1) {
-                struct TcpError error = {errno, "couldn't send data"};
-                throw error;
-            }
+        for (size_t i = 0; i < std::max(count, (size_t)1); i++) {
+            this->threads.emplace_back([this] { this->run(); });
         }
     }
+    void start() { this->start(1); }
 
-    std::vector<uint8_t> recv() {
-        if (!this->is_bound()) {
-            struct TcpError error = {-2, "socket unbound"};
-            throw error;
+    // Stop accepting and wait for the threads to return, connections already
+    // handed over are left to their servers
+    void stop() {
+        if (this->threads.empty()) {
+            return;
         }
-        if (!this->is_connected()) {
-            struct TcpError error = {-2, "socket disconnected"};
-            throw error;
+
+        uint64_t one = 1;
+        auto written = ::write(this->stopfd, &one, sizeof one);
+        (void)written;
+        for (auto& thread : this->threads) {
+            thread.join();
         }
+        this->threads.clear();
 
-        std::vector<uint8_t> data;
-        std::vector<uint8_t> packet(this->packet_len, 0);
+        uint64_t stops;
+        auto reset = ::read(this->stopfd, &stops, sizeof stops);
+        (void)reset;
+    }
 
-        auto received = 0;
-        uint8_t count;
-        auto i = 0;
-        while (true) {
-            // Receive a packet
-            received = ::recv(*this->remote_sockfd, packet.data(),
-                              this->packet_len, 0);
-            if (received == -1) {
-                struct TcpError error = {errno, "couldn't send data"};
-                throw error;
-            } else if (received != this->packet_len) {
-                struct TcpError error = {1, "invalid received packet length"};
-                throw error;
+    // Number of connections accepted so far
+    uint64_t accepted() { return this->accepted_count; }
+};
+
+// Tiny HTTP endpoint serving the library metrics to Prometheus scrapers
+//
+// Requests are answered one at a time on a background thread, reading the
+// metrics never blocks the threads updating them
+class TcpMetricsExporter {
+    // Longest wait between failed accepts, which is also how long stopping
+    // may take while they fail
+    static constexpr std::chrono::milliseconds max_backoff{100};
+
+    TcpSocket socket;
+    std::thread thread;
+    std::atomic<bool> stopping;
+
+    // Answer a single scrape on the accepted connection
+    void answer() {
+        auto fd = *this->socket.remote_sockfd;
+
+        // Don't let a stuck scraper hold the endpoint
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+        // Read the request head, the body of a GET is empty
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos &&
+               request.size() < 8192) {
+            auto received = ::recv(fd, buffer, sizeof buffer, 0);
+            if (received <= 0) {
+                return;
             }
+            request.append(buffer, received);
+        }
 
-            // Extract the chunk length
-            count = packet[0];
-            // Append the chunk to the data
-            for (i = 1; i <= count; i++) {
-                data.push_back(packet[i]);
+        std::string status = "200 OK";
+        std::string type =
+            "application/openmetrics-text; version=1.0.0; charset=utf-8";
+        std::string body;
+        if (request.rfind("GET /metrics ", 0) == 0 ||
+            request.rfind("GET / ", 0) == 0) {
+            body = TcpMetrics::render();
+        } else {
+            status = "404 Not Found";
+            type = "text/plain; charset=utf-8";
+            body = "not found\n";
+        }
+
+        auto response = "HTTP/1.1 " + status + "\r\nContent-Type: " + type +
+                        "\r\nContent-Length: " + std::to_string(body.size()) +
+                        "\r\nConnection: close\r\n\r\n" + body;
+        this->socket.write_all((uint8_t const*)response.data(),
+                               response.size());
+    }
+
+    void serve() {
+        // Accepting may keep failing for a while, when out of descriptors for
+        // instance, so wait longer and longer before trying again
+        auto backoff = std::chrono::milliseconds(0);
+        while (!this->stopping) {
+            try {
+                this->socket.accept();
+            } catch (TcpError&) {
+                backoff = std::clamp(backoff * 2, std::chrono::milliseconds(1),
+                                     max_backoff);
+                std::this_thread::sleep_for(backoff);
+                continue;
             }
+            backoff = std::chrono::milliseconds(0);
 
-            // If the chunk length is smaller than the max length it was the
-            // last packet
-            if (count < this->packet_len - 1) {
-                break;
+            try {
+                this->answer();
+            } catch (TcpError&) {
             }
+            this->socket.disconnect();
         }
+    }
 
-        return data;
+  public:
+    // Start serving the metrics on the specified port
+    TcpMetricsExporter(std::string const& port) {
+        this->socket.bind(port);
+        this->stopping = false;
+        this->thread = std::thread([this] { this->serve(); });
+    }
+    TcpMetricsExporter(TcpMetricsExporter const&) = delete;
+    TcpMetricsExporter& operator=(TcpMetricsExporter const&) = delete;
+
+    // Stop serving on drop
+    ~TcpMetricsExporter() {
+        this->stopping = true;
+        // Wake the thread up from "accept"
+        shutdown(*this->socket.sockfd, SHUT_RDWR);
+        this->thread.join();
     }
 };
 
@@ -0,0 +1,364 @@
+#include "nix_tcp.hpp"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counters of the calling thread, read through perf_event_open
+//
+// Counters the kernel doesn't let us open (no PMU in a VM, strict
+// perf_event_paranoid, ...) are simply reported as unavailable
+class PerfCounters {
+  public:
+    enum Event {
+        cycles,
+        instructions,
+        cache_misses,
+        branch_misses,
+        context_switches,
+        events,
+    };
+
+    static constexpr char const* names[events] = {
+        "cycles",        "instructions", "cache-misses",
+        "branch-misses", "ctx-switches",
+    };
+
+  private:
+    int fds[events];
+
+    static int open(uint32_t type, uint64_t config) {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+
+        // Count kernel time too if allowed, syscalls are most of the cost
+        auto fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd == -1) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+        return fd;
+    }
+
+  public:
+    PerfCounters() {
+        this->fds[cycles] =
+            open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        this->fds[instructions] =
+            open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        this->fds[cache_misses] =
+            open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        this->fds[branch_misses] =
+            open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        this->fds[context_switches] =
+            open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+    }
+    PerfCounters(PerfCounters const&) = delete;
+    PerfCounters& operator=(PerfCounters const&) = delete;
+
+    ~PerfCounters() {
+        for (auto fd : this->fds) {
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+    }
+
+    void start() {
+        for (auto fd : this->fds) {
+            if (fd != -1) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop() {
+        for (auto fd : this->fds) {
+            if (fd != -1) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    // Value of a counter, -1 if unavailable
+    int64_t read(Event event) {
+        uint64_t value;
+        if (this->fds[event] == -1 ||
+            ::read(this->fds[event], &value, sizeof value) != sizeof value) {
+            return -1;
+        }
+        return value;
+    }
+};
+
+// Counter values summed over the threads taking part in a benchmark
+struct Sample {
+    int64_t values[PerfCounters::events] = {0};
+
+    void add(PerfCounters& counters) {
+        for (auto i = 0; i < PerfCounters::events; i++) {
+            auto value = counters.read((PerfCounters::Event)i);
+            if (value == -1 || this->values[i] == -1) {
+                this->values[i] = -1;
+            } else {
+                this->values[i] += value;
+            }
+        }
+    }
+};
+
+// Send "count" messages of "size" bytes from one socket to another and
+// report throughput and counters per message
+void send_recv(std::string const& port, size_t size, size_t count,
+               uint8_t packet_len) {
+    Sample sample;
+    std::mutex sample_lock;
+    std::chrono::nanoseconds elapsed(0);
+
+    std::thread receiver([&] {
+        try {
+            TcpSocket sck(packet_len);
+            sck.bind(port);
+            sck.accept();
+
+            PerfCounters counters;
+            auto start = std::chrono::steady_clock::now();
+            counters.start();
+            for (size_t i = 0; i < count; i++) {
+                sck.recv();
+            }
+            counters.stop();
+            elapsed = std::chrono::steady_clock::now() - start;
+
+            std::lock_guard<std::mutex> guard(sample_lock);
+            sample.add(counters);
+        } catch (TcpError err) {
+            std::cout << "Receiver error [" << err.code << "] "
+                      << err.message << std::endl;
+            std::abort();
+        }
+    });
+
+    std::thread sender([&] {
+        try {
+            TcpSocket sck(packet_len);
+            sck.bind("0");
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            sck.connect("localhost", port);
+
+            std::vector<uint8_t> data(size, 42);
+            PerfCounters counters;
+            counters.start();
+            for (size_t i = 0; i < count; i++) {
+                sck.send(data);
+            }
+            counters.stop();
+
+            std::lock_guard<std::mutex> guard(sample_lock);
+            sample.add(counters);
+        } catch (TcpError err) {
+            std::cout << "Sender error [" << err.code << "] " << err.message
+                      << std::endl;
+            std::abort();
+        }
+    });
+
+    sender.join();
+    receiver.join();
+
+    auto seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::setw(10) << size << std::setw(12) << std::fixed
+              << std::setprecision(0) << count / seconds << std::setw(10)
+              << std::setprecision(1) << size * count / seconds / 1e6;
+    for (auto value : sample.values) {
+        if (value == -1) {
+            std::cout << std::setw(15) << "n/a";
+        } else {
+            std::cout << std::setw(15) << std::setprecision(1)
+                      << (double)value / count;
+        }
+    }
+    std::cout << std::endl;
+}
+
+// Resident memory of the process, in bytes
+size_t resident_memory() {
+    long pages = 0;
+    auto file = std::fopen("/proc/self/statm", "r");
+    if (file != nullptr) {
+        if (std::fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        std::fclose(file);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Open as many connections to a server as the file descriptor limit allows,
+// up to "count", have each of them send a message and go idle, and report the
+// memory the server holds per connection, returns the number of connections
+// opened
+size_t idle_memory(std::string const& port, size_t count, uint8_t packet_len) {
+    // Both ends of every connection live in this process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    count = std::min(count, (size_t)(limit.rlim_cur - 64) / 2);
+
+    TcpServer srv(packet_len);
+    srv.bind(port);
+    size_t received = 0;
+    srv.on_message([&](TcpServer&, TcpConnection, std::vector<uint8_t>&&) {
+        received++;
+    });
+
+    std::vector<uint8_t> packet(packet_len, 0);
+    packet[0] = 1;
+    auto start_resident = resident_memory();
+
+    // Plain sockets keep the client side from weighing on the figures
+    std::vector<int> clients;
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* info;
+    if (getaddrinfo("127.0.0.1", port.c_str(), &hints, &info) != 0) {
+        std::abort();
+    }
+    while (clients.size() < count) {
+        // Connect in batches the listen backlog can hold
+        for (auto i = 0; i < 512 && clients.size() < count; i++) {
+            auto fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen) ||
+                send(fd, packet.data(), packet.size(), 0) == -1) {
+                std::cout << "couldn't open connection " << clients.size()
+                          << std::endl;
+                std::abort();
+            }
+            clients.push_back(fd);
+        }
+        while (received < clients.size()) {
+            srv.run_once(100);
+        }
+    }
+    freeaddrinfo(info);
+
+    auto resident = resident_memory() - start_resident;
+    std::cout << std::setw(12) << count << std::setw(18) << std::fixed
+              << std::setprecision(1) << (double)srv.memory() / count
+              << std::setw(18) << (double)resident / count << std::endl;
+
+    for (auto fd : clients) {
+        close(fd);
+    }
+    while (srv.size() > 0) {
+        srv.run_once(100);
+    }
+    return count;
+}
+
+// Throughput of the kernels for every instruction set the CPU supports, in
+// MB/s of message data
+void kernels(uint8_t packet_len) {
+    auto const rounds = 200;
+    std::vector<uint8_t> data(1 << 20, 42);
+    auto packets = TcpPacketEncoder::packets(packet_len, data.size());
+    std::vector<uint8_t> wire(packets * packet_len);
+
+    for (auto level = 0; level <= TcpCpu::supported(); level++) {
+        auto kernels = TcpKernels::pick((TcpCpu::Level)level);
+        std::chrono::nanoseconds encode(0);
+        std::chrono::nanoseconds strip(0);
+        std::chrono::nanoseconds crc(0);
+        uint32_t sum = 0;
+
+        for (auto i = 0; i < rounds; i++) {
+            size_t offset = 0;
+            auto start = std::chrono::steady_clock::now();
+            kernels.encode(packet_len, data.data(), data.size(), offset,
+                           SIZE_MAX, wire.data());
+            auto encoded = std::chrono::steady_clock::now();
+            kernels.strip(packet_len, wire.data(), packets, data.size());
+            auto stripped = std::chrono::steady_clock::now();
+            sum += kernels.crc32c(data.data(), data.size());
+            auto summed = std::chrono::steady_clock::now();
+
+            encode += encoded - start;
+            strip += stripped - encoded;
+            crc += summed - stripped;
+        }
+        // Keep the checksums from being optimized out
+        if (sum == 1) {
+            std::cout << sum;
+        }
+
+        auto rate = [&](std::chrono::nanoseconds elapsed) {
+            return data.size() * rounds /
+                   std::chrono::duration<double>(elapsed).count() / 1e6;
+        };
+        std::cout << std::setw(10) << TcpCpu::name((TcpCpu::Level)level)
+                  << std::setw(12) << std::fixed << std::setprecision(0)
+                  << rate(encode) << std::setw(12) << rate(strip)
+                  << std::setw(12) << rate(crc) << std::endl;
+    }
+}
+
+int main() {
+    // Counters are given per message, summed over sender and receiver
+    std::cout << std::setw(10) << "size" << std::setw(12) << "msg/s"
+              << std::setw(10) << "MB/s";
+    for (auto name : PerfCounters::names) {
+        std::cout << std::setw(15) << name;
+    }
+    std::cout << std::endl;
+
+    // None of the sizes is a multiple of the chunk length, which the packet
+    // format can't terminate
+    for (size_t size : {16, 256, 4096, 65536, 1 << 20}) {
+        // Move roughly the same amount of data for every size
+        auto count = std::max((size_t)200, ((size_t)64 << 20) / size);
+        count = std::min(count, (size_t)200000);
+        send_recv("1234", size, count, 64);
+    }
+
+    // Resident memory also counts the client sockets, but not the kernel
+    // buffers of either side
+    std::cout << std::endl
+              << std::setw(12) << "connections" << std::setw(18)
+              << "server B/conn" << std::setw(18) << "resident B/conn"
+              << std::endl;
+    for (size_t count : {1000, 10000, 100000}) {
+        if (idle_memory("1235", count, 64) < count) {
+            break;
+        }
+    }
+
+    // The benchmarks above ran with the kernels of the level NIX_TCP_ISA
+    // allows, while these are timed at every level the CPU supports
+    std::cout << std::endl
+              << "kernels (using " << TcpCpu::name(TcpCpu::level()) << ")"
+              << std::endl
+              << std::setw(10) << "isa" << std::setw(12) << "encode"
+              << std::setw(12) << "strip" << std::setw(12) << "crc32c"
+              << std::endl;
+    kernels(64);
+}
@@ -0,0 +1,273 @@
+#include "nix_tcp.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Replays a capture against a server
+//
+//   nix_tcp_replay capture host port [speed] [received|sent] [packet_len]
+//
+// Every connection of the capture gets a connection of its own to the
+// server, on which the messages recorded in the given direction are sent
+// again ("received" by default, which is the traffic a server saw coming in).
+// "speed" scales time: 1 (the default) keeps the original pacing, 2 goes
+// twice as fast, "max" sends everything as fast as possible
+
+using Clock = std::chrono::steady_clock;
+
+// Calls a function once the scope it lives in is left, however it is left
+template <typename F>
+class ScopeExit {
+    F f;
+
+  public:
+    ScopeExit(F f) : f(std::move(f)) {}
+    ScopeExit(ScopeExit const&) = delete;
+    ScopeExit& operator=(ScopeExit const&) = delete;
+    ~ScopeExit() { this->f(); }
+};
+
+// Connection to the server on behalf of a captured one
+struct Peer {
+    int fd;
+    // Responses received so far, which are decoded only to be counted
+    TcpPacketDecoder decoder;
+    std::vector<uint8_t> input;
+    size_t input_len;
+};
+
+// Open a blocking connection to the server
+int connect_to(std::string const& host, std::string const& port) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* info;
+    auto gai_ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &info);
+    if (gai_ret != 0) {
+        struct TcpError error = {gai_ret, gai_strerror(gai_ret)};
+        throw error;
+    }
+
+    auto fd = -1;
+    for (auto i = info; i != nullptr; i = i->ai_next) {
+        fd = socket(i->ai_family, i->ai_socktype | SOCK_CLOEXEC,
+                    i->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, i->ai_addr, i->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(info);
+
+    if (fd == -1) {
+        struct TcpError error = {errno, "couldn't connect to server"};
+        throw error;
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cout << "usage: " << argv[0]
+                  << " capture host port [speed|max] [received|sent]"
+                     " [packet_len]"
+                  << std::endl;
+        return 2;
+    }
+    std::string host = argv[2];
+    std::string port = argv[3];
+    auto speed = argc >= 5 && std::string(argv[4]) != "max"
+                     ? std::stod(argv[4])
+                     : argc >= 5 ? 0 : 1;
+    auto direction = argc >= 6 && std::string(argv[5]) == "sent"
+                         ? TcpCapture::sent
+                         : TcpCapture::received;
+    uint8_t packet_len = argc >= 7 ? std::stoi(argv[6]) : 64;
+
+    try {
+        TcpCaptureReader capture(argv[1]);
+
+        std::unordered_map<uint64_t, std::unique_ptr<Peer>> peers;
+        std::mutex peers_lock;
+        auto epollfd = epoll_create1(EPOLL_CLOEXEC);
+        size_t responses = 0;
+        // Connections whose responses couldn't be decoded, and aren't read
+        // anymore
+        size_t dropped = 0;
+        bool done = false;
+
+        // Read and count the responses so that the server never blocks on
+        // a full socket
+        std::thread drain([&] {
+            while (true) {
+                struct epoll_event events[64];
+                auto count = epoll_wait(epollfd, events, 64, 100);
+
+                std::lock_guard<std::mutex> guard(peers_lock);
+                if (count <= 0 && done) {
+                    return;
+                }
+                for (auto i = 0; i < count; i++) {
+                    auto& peer = *(Peer*)events[i].data.ptr;
+                    auto received = ::recv(peer.fd,
+                                           peer.input.data() + peer.input_len,
+                                           peer.input.size() - peer.input_len,
+                                           MSG_DONTWAIT);
+                    if (received <= 0) {
+                        if (received == 0) {
+                            epoll_ctl(epollfd, EPOLL_CTL_DEL, peer.fd,
+                                      nullptr);
+                        }
+                        continue;
+                    }
+                    peer.input_len += received;
+
+                    size_t consumed;
+                    try {
+                        consumed = peer.decoder.decode(
+                            peer.input.data(), peer.input_len, SIZE_MAX,
+                            [&](std::vector<uint8_t>&&) { responses++; });
+                    } catch (TcpError&) {
+                        epoll_ctl(epollfd, EPOLL_CTL_DEL, peer.fd, nullptr);
+                        peer.input_len = 0;
+                        dropped++;
+                        continue;
+                    }
+                    std::memmove(peer.input.data(),
+                                 peer.input.data() + consumed,
+                                 peer.input_len - consumed);
+                    peer.input_len -= consumed;
+                }
+            }
+        });
+
+        // Stop the thread and close every connection whichever way the
+        // replay ends, an error included
+        auto stop = [&] {
+            if (drain.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(peers_lock);
+                    done = true;
+                }
+                drain.join();
+            }
+        };
+        ScopeExit cleanup([&] {
+            stop();
+            for (auto& entry : peers) {
+                // Empty if connecting failed
+                if (entry.second) {
+                    close(entry.second->fd);
+                }
+            }
+            close(epollfd);
+        });
+
+        size_t messages = 0;
+        size_t bytes = 0;
+        Clock::duration lag(0);
+        std::vector<uint8_t> packets;
+        auto start = Clock::now();
+
+        while (auto record = capture.next()) {
+            if (record->direction != direction) {
+                continue;
+            }
+
+            Peer* peer;
+            {
+                std::lock_guard<std::mutex> guard(peers_lock);
+                auto& entry = peers[record->connection];
+                if (!entry) {
+                    entry.reset(new Peer{connect_to(host, port),
+                                         TcpPacketDecoder(packet_len),
+                                         std::vector<uint8_t>(1 << 16), 0});
+                    struct epoll_event event;
+                    std::memset(&event, 0, sizeof event);
+                    event.events = EPOLLIN;
+                    event.data.ptr = entry.get();
+                    epoll_ctl(epollfd, EPOLL_CTL_ADD, entry->fd, &event);
+                }
+                peer = entry.get();
+            }
+
+            // Keep to the original schedule, scaled
+            if (speed > 0) {
+                auto due = start + std::chrono::duration_cast<Clock::duration>(
+                                       record->time / speed);
+                auto now = Clock::now();
+                if (due > now) {
+                    std::this_thread::sleep_until(due);
+                } else {
+                    lag = std::max(lag, now - due);
+                }
+            }
+
+            std::vector<uint8_t> data(record->data,
+                                      record->data + record->size);
+            packets.resize(TcpPacketEncoder::packets(packet_len, data.size()) *
+                           packet_len);
+            size_t offset = 0;
+            TcpPacketEncoder::encode(packet_len, data, offset, SIZE_MAX,
+                                     packets.data());
+            size_t sent = 0;
+            while (sent < packets.size()) {
+                auto len = ::send(peer->fd, packets.data() + sent,
+                                  packets.size() - sent, MSG_NOSIGNAL);
+                if (len == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    struct TcpError error = {errno, "couldn't send message"};
+                    throw error;
+                }
+                sent += len;
+            }
+
+            messages++;
+            bytes += record->size;
+        }
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+
+        // Give the server some time to answer the last messages
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        stop();
+
+        std::cout << "connections: " << peers.size() << std::endl
+                  << "messages:    " << messages << " (" << bytes
+                  << " bytes)" << std::endl
+                  << "responses:   " << responses << std::endl
+                  << "dropped:     " << dropped << std::endl
+                  << "elapsed:     " << std::fixed << std::setprecision(3)
+                  << elapsed.count() << " s" << std::endl
+                  << "rate:        " << std::setprecision(0)
+                  << messages / elapsed.count() << " msg/s" << std::endl;
+        if (speed > 0) {
+            std::cout << "max lag:     " << std::setprecision(3)
+                      << std::chrono::duration<double, std::milli>(lag)
+                             .count()
+                      << " ms" << std::endl;
+        }
+    } catch (TcpError err) {
+        std::cout << "Error [" << err.code << "] " << err.message
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
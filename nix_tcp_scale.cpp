@@ -0,0 +1,437 @@
+#include "nix_tcp.hpp"
+
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Scalability and soak benchmark of TcpServer
+//
+//   nix_tcp_scale [connections]              ramp up to "connections"
+//   nix_tcp_scale soak seconds [connections] hold and churn connections
+//
+// Both ends of every connection live in this process, so the file
+// descriptor limit is raised to its hard maximum and the number of
+// connections clipped to what it allows
+
+using Clock = std::chrono::steady_clock;
+
+auto const port = "1238";
+uint8_t const packet_len = 64;
+
+// Raise the file descriptor limit as far as allowed and return the number of
+// connections it leaves room for
+size_t raise_fd_limit() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    return (limit.rlim_cur - 64) / 2;
+}
+
+// Resident memory of the process, in bytes
+size_t resident_memory() {
+    long pages = 0;
+    auto file = std::fopen("/proc/self/statm", "r");
+    if (file != nullptr) {
+        if (std::fscanf(file, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        std::fclose(file);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Number of file descriptors open in the process
+size_t open_fds() {
+    size_t count = 0;
+    auto dir = opendir("/proc/self/fd");
+    if (dir == nullptr) {
+        return 0;
+    }
+    while (readdir(dir) != nullptr) {
+        count++;
+    }
+    closedir(dir);
+    // ".", ".." and the descriptor of the directory itself
+    return count - 3;
+}
+
+// Echo server running on its own thread
+//
+// The server may only be touched from its thread, so its figures are
+// published through atomics
+class EchoServer {
+    TcpServer srv;
+    std::thread thread;
+
+    std::atomic<bool> stopping;
+    std::atomic<size_t> connections;
+    std::atomic<bool> memory_wanted;
+    std::atomic<size_t> memory_bytes;
+
+  public:
+    EchoServer() : srv(packet_len) {
+        this->stopping = false;
+        this->connections = 0;
+        this->memory_wanted = false;
+        this->memory_bytes = 0;
+
+        this->srv.bind(port);
+        this->srv.on_message([](TcpServer& srv, TcpConnection id,
+                                std::vector<uint8_t>&& message) {
+            srv.send(id, message);
+        });
+        this->thread = std::thread([this] {
+            try {
+                while (!this->stopping) {
+                    this->srv.run_once(10);
+                    this->connections = this->srv.size();
+                    if (this->memory_wanted) {
+                        this->memory_bytes = this->srv.memory();
+                        this->memory_wanted = false;
+                    }
+                }
+            } catch (TcpError err) {
+                std::cout << "Server error [" << err.code << "] "
+                          << err.message << std::endl;
+                std::abort();
+            }
+        });
+    }
+    EchoServer(EchoServer const&) = delete;
+    EchoServer& operator=(EchoServer const&) = delete;
+
+    ~EchoServer() {
+        this->stopping = true;
+        this->thread.join();
+    }
+
+    // Number of connections the server holds
+    size_t size() { return this->connections; }
+
+    // Wait for the server to hold "count" connections
+    void wait_for(size_t count) {
+        while (this->connections != count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    // Memory the server holds for its connections
+    size_t memory() {
+        this->memory_wanted = true;
+        while (this->memory_wanted) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return this->memory_bytes;
+    }
+};
+
+// Echo throughput and round trip times over a set of connections
+struct Echoes {
+    double per_second;
+    double p50_us;
+    double p99_us;
+};
+
+// Client side of the connections, plain sockets so that it weighs as little
+// as possible on the figures of the server
+class Clients {
+    std::vector<int> fds;
+    struct sockaddr_in server;
+    // Connections opened so far, spread over source addresses to get past
+    // the ephemeral port range of a single one
+    size_t opened;
+
+  public:
+    Clients() {
+        std::memset(&this->server, 0, sizeof this->server);
+        this->server.sin_family = AF_INET;
+        this->server.sin_port = htons(std::stoi(port));
+        this->server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        this->opened = 0;
+    }
+    Clients(Clients const&) = delete;
+    Clients& operator=(Clients const&) = delete;
+
+    ~Clients() { this->close(this->fds.size()); }
+
+    size_t size() { return this->fds.size(); }
+
+    // Open "count" more connections
+    void open(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            auto fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd == -1) {
+                struct TcpError error = {errno, "couldn't create socket"};
+                throw error;
+            }
+
+            int yes = 1;
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes,
+                       sizeof yes);
+            struct sockaddr_in source;
+            std::memset(&source, 0, sizeof source);
+            source.sin_family = AF_INET;
+            source.sin_addr.s_addr =
+                htonl(INADDR_LOOPBACK + 1 + (this->opened / 20000) % 250);
+            this->opened++;
+
+            if (::bind(fd, (struct sockaddr*)&source, sizeof source) == -1 ||
+                connect(fd, (struct sockaddr*)&this->server,
+                        sizeof this->server) == -1) {
+                struct TcpError error = {errno, "couldn't connect"};
+                ::close(fd);
+                throw error;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            this->fds.push_back(fd);
+        }
+    }
+
+    // Close "count" connections, picked at random
+    void close(size_t count) {
+        static std::mt19937 random(42);
+        for (size_t i = 0; i < count && !this->fds.empty(); i++) {
+            std::uniform_int_distribution<size_t> pick(0, this->fds.size() - 1);
+            auto index = pick(random);
+            ::close(this->fds[index]);
+            this->fds[index] = this->fds.back();
+            this->fds.pop_back();
+        }
+    }
+
+    // Keep one message in flight on each of "active" connections spread over
+    // the whole set for "duration", and measure the echoes
+    Echoes echo(size_t active, std::chrono::milliseconds duration) {
+        active = std::min(active, this->fds.size());
+        auto stride = this->fds.size() / std::max(active, (size_t)1);
+
+        // A single packet holding a message of one byte
+        uint8_t packet[packet_len] = {1, 42};
+
+        auto epollfd = epoll_create1(EPOLL_CLOEXEC);
+        std::vector<int> fds;
+        std::vector<size_t> received(active, 0);
+        std::vector<Clock::time_point> sent(active);
+        for (size_t i = 0; i < active; i++) {
+            auto fd = this->fds[i * stride];
+            fds.push_back(fd);
+
+            struct epoll_event event;
+            std::memset(&event, 0, sizeof event);
+            event.events = EPOLLIN;
+            event.data.u64 = i;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+
+            sent[i] = Clock::now();
+            ::send(fd, packet, packet_len, MSG_NOSIGNAL);
+        }
+
+        std::vector<uint64_t> rtts;
+        auto in_flight = active;
+        auto start = Clock::now();
+        auto end = start + duration;
+        // Stop sending once the time is up, but collect every echo so that
+        // none is left over for the next run
+        while (in_flight > 0) {
+            struct epoll_event events[256];
+            auto count = epoll_wait(epollfd, events, 256, 1000);
+            if (count <= 0) {
+                if (count == 0) {
+                    std::cout << "echoes timed out" << std::endl;
+                    std::abort();
+                }
+                continue;
+            }
+
+            auto now = Clock::now();
+            for (auto j = 0; j < count; j++) {
+                auto i = events[j].data.u64;
+                uint8_t buf[packet_len];
+                auto len = ::recv(fds[i], buf, packet_len - received[i], 0);
+                if (len <= 0) {
+                    continue;
+                }
+                received[i] += len;
+                if (received[i] < packet_len) {
+                    continue;
+                }
+
+                received[i] = 0;
+                rtts.push_back(std::chrono::duration_cast<
+                                   std::chrono::nanoseconds>(now - sent[i])
+                                   .count());
+                if (now < end) {
+                    sent[i] = now;
+                    ::send(fds[i], packet, packet_len, MSG_NOSIGNAL);
+                } else {
+                    in_flight--;
+                }
+            }
+        }
+        ::close(epollfd);
+
+        auto seconds = std::chrono::duration<double>(Clock::now() - start);
+        std::sort(rtts.begin(), rtts.end());
+        if (rtts.empty()) {
+            return {0, 0, 0};
+        }
+        return {rtts.size() / seconds.count(),
+                rtts[rtts.size() / 2] / 1e3,
+                rtts[rtts.size() * 99 / 100] / 1e3};
+    }
+};
+
+// Grow the number of connections step by step, measuring the server at
+// every step
+void ramp(size_t max_connections) {
+    EchoServer server;
+    Clients clients;
+    auto start_resident = resident_memory();
+
+    std::cout << std::setw(12) << "connections" << std::setw(12)
+              << "accept/s" << std::setw(16) << "server B/conn"
+              << std::setw(18) << "resident B/conn" << std::setw(12)
+              << "echo/s" << std::setw(10) << "p50 us" << std::setw(10)
+              << "p99 us" << std::endl;
+
+    std::vector<size_t> steps = {1000, 2000, 5000, 10000, 20000, 50000,
+                                 100000, 200000, 500000, 1000000};
+    for (auto step : steps) {
+        step = std::min(step, max_connections);
+        if (step <= clients.size()) {
+            break;
+        }
+
+        auto start = Clock::now();
+        auto count = step - clients.size();
+        clients.open(count);
+        server.wait_for(step);
+        auto elapsed = std::chrono::duration<double>(Clock::now() - start);
+
+        auto memory = server.memory();
+        auto resident = resident_memory() - start_resident;
+        auto echoes = clients.echo(64, std::chrono::milliseconds(1000));
+
+        std::cout << std::setw(12) << step << std::setw(12) << std::fixed
+                  << std::setprecision(0) << count / elapsed.count()
+                  << std::setw(16) << std::setprecision(1)
+                  << (double)memory / step << std::setw(18)
+                  << (double)resident / step << std::setw(12)
+                  << std::setprecision(0) << echoes.per_second
+                  << std::setw(10) << std::setprecision(1) << echoes.p50_us
+                  << std::setw(10) << echoes.p99_us << std::endl;
+    }
+}
+
+// Hold "connections" connections for "seconds", replacing a tenth of them
+// and exchanging messages every second, and check that neither memory nor
+// file descriptors grow over time
+//
+// Returns whether no leak was detected
+bool soak(size_t seconds, size_t connections) {
+    EchoServer server;
+    Clients clients;
+    clients.open(connections);
+    server.wait_for(connections);
+
+    // Everything allocated on the first round is reused afterwards, so it
+    // serves as the baseline
+    size_t base_fds = 0;
+    size_t base_resident = 0;
+    size_t base_memory = 0;
+
+    std::cout << std::setw(8) << "second" << std::setw(12) << "fds"
+              << std::setw(14) << "resident KB" << std::setw(14)
+              << "server KB" << std::setw(12) << "echo/s" << std::setw(10)
+              << "p99 us" << std::endl;
+
+    auto leaked = false;
+    for (size_t second = 1; second <= seconds; second++) {
+        auto round_start = Clock::now();
+
+        auto churn = std::max(connections / 10, (size_t)1);
+        clients.close(churn);
+        server.wait_for(connections - churn);
+        clients.open(churn);
+        server.wait_for(connections);
+        auto echoes = clients.echo(64, std::chrono::milliseconds(500));
+
+        auto fds = open_fds();
+        auto resident = resident_memory();
+        auto memory = server.memory();
+        if (second == 1) {
+            base_fds = fds;
+            base_resident = resident;
+            base_memory = memory;
+        }
+
+        // Allow for allocator noise, but not for steady growth
+        auto fd_leak = fds != base_fds;
+        auto memory_leak =
+            resident > base_resident + std::max(base_resident / 20,
+                                                (size_t)4 << 20) ||
+            memory > base_memory + std::max(base_memory / 20,
+                                            (size_t)1 << 20);
+        if (fd_leak || memory_leak) {
+            leaked = true;
+        }
+
+        if (second == 1 || second % 10 == 0 || second == seconds || fd_leak ||
+            memory_leak) {
+            std::cout << std::setw(8) << second << std::setw(12) << fds
+                      << std::setw(14) << resident / 1024 << std::setw(14)
+                      << memory / 1024 << std::setw(12) << std::fixed
+                      << std::setprecision(0) << echoes.per_second
+                      << std::setw(10) << std::setprecision(1)
+                      << echoes.p99_us
+                      << (fd_leak ? "  fd leak" : "")
+                      << (memory_leak ? "  memory growth" : "") << std::endl;
+        }
+
+        std::this_thread::sleep_until(round_start + std::chrono::seconds(1));
+    }
+
+    return !leaked;
+}
+
+int main(int argc, char** argv) {
+    auto max_connections = raise_fd_limit();
+
+    try {
+        if (argc >= 3 && std::string(argv[1]) == "soak") {
+            auto seconds = std::stoul(argv[2]);
+            auto connections = argc >= 4 ? std::stoul(argv[3]) : 10000;
+            if (connections > max_connections) {
+                std::cout << "limited to " << max_connections
+                          << " connections by RLIMIT_NOFILE" << std::endl;
+                connections = max_connections;
+            }
+            return soak(seconds, connections) ? 0 : 1;
+        }
+
+        auto connections = argc >= 2 ? std::stoul(argv[1]) : 100000;
+        if (connections > max_connections) {
+            std::cout << "limited to " << max_connections
+                      << " connections by RLIMIT_NOFILE" << std::endl;
+            connections = max_connections;
+        }
+        ramp(connections);
+    } catch (TcpError err) {
+        std::cout << "Error [" << err.code << "] " << err.message
+                  << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,294 @@
+#include "nix_tcp.hpp"
+
+#include <dlfcn.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// System calls and allocations made by the current thread
+//
+// The functions below take precedence over the libc ones for calls made from
+// this executable, so every socket call the library makes goes through them
+thread_local size_t syscalls = 0;
+thread_local size_t allocations = 0;
+
+template <typename F>
+F next_symbol(F, char const* name) {
+    return (F)dlsym(RTLD_NEXT, name);
+}
+
+#define INTERPOSE(ret, name, params, args)                                    \
+    extern "C" ret name params {                                              \
+        static auto real = next_symbol(&name, #name);                         \
+        syscalls++;                                                           \
+        return real args;                                                     \
+    }
+
+INTERPOSE(ssize_t, send, (int fd, void const* buf, size_t len, int flags),
+          (fd, buf, len, flags))
+INTERPOSE(ssize_t, recv, (int fd, void* buf, size_t len, int flags),
+          (fd, buf, len, flags))
+INTERPOSE(ssize_t, recvmsg, (int fd, struct msghdr* msg, int flags),
+          (fd, msg, flags))
+INTERPOSE(ssize_t, splice,
+          (int in, loff_t* in_off, int out, loff_t* out_off, size_t len,
+           unsigned int flags),
+          (in, in_off, out, out_off, len, flags))
+INTERPOSE(int, epoll_wait,
+          (int epfd, struct epoll_event* events, int max, int timeout),
+          (epfd, events, max, timeout))
+INTERPOSE(int, epoll_ctl,
+          (int epfd, int op, int fd, struct epoll_event* event),
+          (epfd, op, fd, event))
+
+// GCC takes the free of these for a mismatch once both ends get inlined
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+    allocations++;
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+// Per message cost of an operation
+struct Cost {
+    double syscalls;
+    double allocations;
+};
+
+// Run "op" "count" times on the current thread and measure its average cost
+template <typename F>
+Cost measure(size_t count, F&& op) {
+    auto start_syscalls = syscalls;
+    auto start_allocations = allocations;
+    for (size_t i = 0; i < count; i++) {
+        op();
+    }
+    return {(double)(syscalls - start_syscalls) / count,
+            (double)(allocations - start_allocations) / count};
+}
+
+auto failures = 0;
+
+void check(std::string const& name, Cost cost, double max_syscalls,
+           double max_allocations) {
+    auto ok = cost.syscalls <= max_syscalls &&
+              cost.allocations <= max_allocations;
+    if (!ok) {
+        failures++;
+    }
+    std::cout << (ok ? "ok   " : "FAIL ") << name << ": " << cost.syscalls
+              << " syscalls (max " << max_syscalls << "), "
+              << cost.allocations << " allocations (max " << max_allocations
+              << ")" << std::endl;
+}
+
+// Number of packets needed for a message of "size" bytes
+size_t packets(uint8_t packet_len, size_t size) {
+    return TcpPacketEncoder::packets(packet_len, size);
+}
+
+// Budgets of TcpSocket::send and TcpSocket::recv, with messages announced
+// ahead of their packets if "announce" is set
+void socket_budgets(uint8_t packet_len, size_t size, bool announce) {
+    auto const count = 20;
+    std::vector<uint8_t> data(size, 1);
+    Cost recv_cost;
+
+    std::thread receiver([&] {
+        TcpSocket sck(packet_len);
+        sck.bind("1234");
+        sck.accept();
+
+        sck.recv();
+        recv_cost = measure(count, [&] { sck.recv(); });
+    });
+
+    TcpSocket sck(packet_len);
+    sck.bind("0");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sck.connect("localhost", "1234");
+    sck.set_length_announcing(announce);
+
+    sck.send(data);
+    auto send_cost = measure(count, [&] { sck.send(data); });
+    receiver.join();
+
+    auto wire = (packets(packet_len, size) + announce) * packet_len;
+    auto name = std::to_string(size) + " bytes / " +
+                std::to_string(packet_len) + (announce ? " announced" : "");
+
+    // One write per 64 KiB chunk of packets, one buffer per message
+    check("socket send " + name, send_cost, (wire + 65535) / 65536, 1);
+    if (announce) {
+        // A read for the announcement and one for the rest, into a message
+        // allocated once
+        check("socket recv " + name, recv_cost, 2, 2);
+    } else {
+        // One read per packet, and the message growing as it is received
+        check("socket recv " + name, recv_cost, packets(packet_len, size),
+              2 + std::ceil(std::log2(size)));
+    }
+}
+void socket_budgets(uint8_t packet_len, size_t size) {
+    socket_budgets(packet_len, size, false);
+}
+
+// Budget of TcpSocket::recv receiving messages into arenas large enough to
+// hold them
+void arena_budgets(uint8_t packet_len, size_t size) {
+    auto const count = 20;
+    std::vector<uint8_t> data(size, 1);
+    Cost recv_cost;
+
+    std::thread receiver([&] {
+        TcpSocket sck(packet_len);
+        sck.bind("1234");
+        sck.accept();
+
+        TcpArenaPool arenas(1 << 20, 1);
+        arenas.release(arenas.acquire());
+        recv_cost = measure(count, [&] {
+            auto arena = arenas.acquire();
+            sck.recv(arena->resource());
+            arenas.release(std::move(arena));
+        });
+    });
+
+    TcpSocket sck(packet_len);
+    sck.bind("0");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sck.connect("localhost", "1234");
+    for (auto i = 0; i < count; i++) {
+        sck.send(data);
+    }
+    receiver.join();
+
+    // One read per packet, and no allocation at all
+    check("arena recv " + std::to_string(size) + " bytes / " +
+              std::to_string(packet_len),
+          recv_cost, packets(packet_len, size), 0);
+}
+
+// Budgets of TcpServer receiving messages and answering them
+void server_budgets(uint8_t packet_len, size_t size) {
+    auto const count = 200;
+    std::vector<uint8_t> data(size, 1);
+    auto received = 0;
+    Cost loop_cost;
+
+    std::thread server([&] {
+        TcpServer srv(packet_len);
+        srv.bind("1235");
+        srv.on_message([&](TcpServer& srv, TcpConnection id,
+                           std::vector<uint8_t>&& message) {
+            received++;
+            srv.send(id, message);
+        });
+
+        // Get the connection accepted first
+        while (srv.size() == 0) {
+            srv.run_once(-1);
+        }
+        loop_cost = measure(1, [&] {
+            while (received < count) {
+                srv.run_once(-1);
+            }
+        });
+    });
+
+    TcpSocket sck(packet_len);
+    sck.bind("0");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    sck.connect("localhost", "1235");
+    for (auto i = 0; i < count; i++) {
+        sck.send(data);
+        sck.recv();
+    }
+    server.join();
+
+    loop_cost.syscalls /= count;
+    loop_cost.allocations /= count;
+
+    auto wire = packets(packet_len, size) * packet_len;
+    auto name = std::to_string(size) + " bytes / " +
+                std::to_string(packet_len);
+
+    // Waits and reads for every 64 KiB of the message as it trickles in, the
+    // read finding the socket drained, and a single write of the answer
+    auto chunks = (wire + 65535) / 65536;
+    check("server echo " + name, loop_cost, 2 + 2 * chunks + 1,
+          4 + std::ceil(std::log2(size)));
+}
+
+// Budget of TcpRelay forwarding messages
+void relay_budgets(uint8_t packet_len, size_t size) {
+    auto const count = 20;
+    std::vector<uint8_t> data(size, 1);
+
+    std::thread sender([&] {
+        TcpSocket sck(packet_len);
+        sck.bind("0");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        sck.connect("localhost", "1236");
+        for (auto i = 0; i < count + 1; i++) {
+            sck.send(data);
+        }
+    });
+    std::thread receiver([&] {
+        TcpSocket sck(packet_len);
+        sck.bind("1237");
+        sck.accept();
+        for (auto i = 0; i < count + 1; i++) {
+            sck.recv();
+        }
+    });
+
+    TcpSocket src(packet_len);
+    src.bind("1236");
+    TcpSocket dst(packet_len);
+    dst.bind("0");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    dst.connect("localhost", "1237");
+    src.accept();
+
+    TcpRelay relay;
+    relay.forward(src, dst);
+    auto cost = measure(count, [&] { relay.forward(src, dst); });
+    sender.join();
+    receiver.join();
+
+    // A peek and a splice per packet, plus the splices emptying the pipe
+    auto n = packets(packet_len, size);
+    check("relay " + std::to_string(size) + " bytes / " +
+              std::to_string(packet_len),
+          cost, 2 * n + 1 + n / 16, 2);
+}
+
+int main() {
+    try {
+        for (auto size : {10, 1000, 100000}) {
+            socket_budgets(64, size);
+            socket_budgets(255, size);
+            socket_budgets(64, size, true);
+            arena_budgets(64, size);
+            server_budgets(64, size);
+            relay_budgets(64, size);
+        }
+    } catch (TcpError err) {
+        std::cout << "Error [" << err.code << "] " << err.message
+                  << std::endl;
+        return 1;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -1,9 +1,18 @@
 #include "nix_tcp.hpp"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -76,9 +85,1563 @@ void thread2() {
     }
 }
 
+void fail(std::string const& message) {
+    std::cout << "FAIL " << message << std::endl;
+    std::abort();
+}
+
+// Plain connection to a local port, to send packets the library never would
+int connect_raw(std::string const& port) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* info;
+    if (getaddrinfo("127.0.0.1", port.c_str(), &hints, &info) != 0) {
+        fail("couldn't resolve localhost");
+    }
+    auto fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, info->ai_addr, info->ai_addrlen) == -1) {
+        fail("couldn't connect to port " + port);
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+// Announcing a message larger than allowed gets the connection closed, not
+// memory allocated for it, and leaves the other connections alone
+void oversized_announcement() {
+    std::vector<uint8_t> packet(64);
+    TcpPacketEncoder::encode_announce(64, (uint64_t)1 << 55, packet.data());
+
+    try {
+        TcpServer srv(64);
+        srv.set_max_message(1 << 20);
+        srv.bind("1240");
+        srv.on_message([](TcpServer& srv, TcpConnection id,
+                          std::vector<uint8_t>&& message) {
+            srv.send(id, message);
+        });
+        std::atomic<bool> done(false);
+        std::thread loop([&] {
+            while (!done) {
+                srv.run_once(10);
+            }
+        });
+
+        TcpSocket good(64);
+        good.bind("0");
+        good.connect("localhost", "1240");
+        std::vector<uint8_t> data(100, 7);
+        good.send(data);
+        if (good.recv() != data) {
+            fail("server didn't echo before the announcement");
+        }
+
+        auto bad = connect_raw("1240");
+        send(bad, packet.data(), packet.size(), MSG_NOSIGNAL);
+        uint8_t byte;
+        if (recv(bad, &byte, 1, 0) != 0) {
+            fail("server kept the connection announcing 2^55 bytes");
+        }
+        close(bad);
+
+        good.send(data);
+        if (good.recv() != data) {
+            fail("server didn't echo after the announcement");
+        }
+        if (srv.size() != 1) {
+            fail("server closed the wrong connections");
+        }
+        done = true;
+        loop.join();
+    } catch (TcpError err) {
+        fail("server error " + err.message);
+    }
+
+    // A socket refuses it as well
+    std::thread sender([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto fd = connect_raw("1241");
+        send(fd, packet.data(), packet.size(), MSG_NOSIGNAL);
+        close(fd);
+    });
+    TcpSocket sck(64);
+    sck.bind("1241");
+    sck.accept();
+    try {
+        sck.recv();
+        fail("socket accepted an announcement of 2^55 bytes");
+    } catch (TcpError err) {
+        if (err.code != EMSGSIZE) {
+            fail("socket error " + err.message);
+        }
+    }
+    sender.join();
+}
+
+// A socket that adapted the length of its packets starts its next
+// connection from the length it was created with, as the new peer expects
+void adapted_reconnect() {
+    try {
+        std::vector<uint8_t> small(10, 1);
+        std::vector<uint8_t> large(100, 2);
+
+        std::thread first([&] {
+            TcpSocket sck(64);
+            sck.bind("1242");
+            sck.accept();
+            for (auto i = 0; i < 64; i++) {
+                if (sck.recv() != small) {
+                    fail("adapted message corrupted");
+                }
+            }
+        });
+        std::thread second([&] {
+            TcpSocket sck(64);
+            sck.bind("1243");
+            sck.accept();
+            for (auto i = 0; i < 2; i++) {
+                if (sck.recv() != large) {
+                    fail("message corrupted after reconnecting");
+                }
+            }
+        });
+
+        TcpSocket sck(64);
+        sck.bind("0");
+        sck.set_adaptive_packet_len(3, 255);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        sck.connect("localhost", "1242");
+        // Enough small messages to get the length reconsidered
+        for (auto i = 0; i < 64; i++) {
+            sck.send(small);
+        }
+        first.join();
+
+        sck.disconnect();
+        sck.connect("localhost", "1243");
+        sck.send(large);
+        sck.send(large);
+        second.join();
+    } catch (TcpError err) {
+        fail("reconnect error " + err.message);
+    }
+}
+
+// Messages received once timestamping is enabled carry a kernel timestamp,
+// which is neither kept nor taken after reconnecting
+void rx_timestamps() {
+    std::vector<uint8_t> data(10, 6);
+    auto echo = [&](std::string const& port) {
+        return std::thread([port] {
+            TcpSocket sck(64);
+            sck.bind(port);
+            sck.accept();
+            // Until the other side hangs up
+            try {
+                while (true) {
+                    sck.send(sck.recv());
+                }
+            } catch (TcpError&) {
+            }
+        });
+    };
+    auto first = echo("1259");
+    auto second = echo("1260");
+
+    try {
+        TcpSocket sck(64);
+        sck.bind("0");
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        sck.connect("localhost", "1259");
+        sck.enable_timestamping();
+        // The kernel may only start timestamping a little later
+        std::optional<std::chrono::nanoseconds> stamp;
+        for (auto i = 0; i < 100 && !stamp.has_value(); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(i));
+            sck.send(data);
+            if (sck.recv() != data) {
+                fail("timestamped message corrupted");
+            }
+            stamp = sck.last_rx_timestamp();
+        }
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        if (!stamp.has_value()) {
+            fail("no receive timestamp with timestamping enabled");
+        } else if (*stamp > now || now - *stamp > std::chrono::seconds(10)) {
+            fail("receive timestamp isn't the time of receipt");
+        }
+        sck.disconnect();
+        first.join();
+
+        sck.connect("localhost", "1260");
+        if (sck.last_rx_timestamp().has_value()) {
+            fail("receive timestamp kept after reconnecting");
+        }
+        sck.send(data);
+        if (sck.recv() != data) {
+            fail("message corrupted after reconnecting");
+        }
+        if (sck.last_rx_timestamp().has_value()) {
+            fail("timestamping kept after reconnecting");
+        }
+        sck.disconnect();
+        second.join();
+    } catch (TcpError err) {
+        fail("timestamping error " + err.message);
+    }
+}
+
+// A backend that is down gets avoided instead of drawing the requests its
+// lack of latency makes it look idle for
+void dead_backend() {
+    TcpServer srv(64);
+    srv.bind("1244");
+    srv.on_message([](TcpServer& srv, TcpConnection id,
+                      std::vector<uint8_t>&& message) {
+        srv.send(id, message);
+    });
+    std::atomic<bool> done(false);
+    std::thread loop([&] {
+        while (!done) {
+            srv.run_once(10);
+        }
+    });
+
+    // Nothing listens on the last port
+    TcpBalancer balancer({{"localhost", "1244"},
+                          {"localhost", "1244"},
+                          {"localhost", "1244"},
+                          {"localhost", "1247"}});
+    std::vector<uint8_t> data(10, 3);
+    auto failed = 0;
+    for (auto i = 0; i < 1000; i++) {
+        try {
+            if (balancer.request(data) != data) {
+                fail("balancer response corrupted");
+            }
+        } catch (TcpError&) {
+            failed++;
+        }
+    }
+    done = true;
+    loop.join();
+
+    // The dead backend is only tried again once its ejection ran out
+    if (failed > 10) {
+        fail("balancer sent " + std::to_string(failed) +
+             " requests out of 1000 to a dead backend");
+    }
+}
+
+// Server answering every message after "delay", with "answer" or the message
+// itself if "answer" is empty, or closing the connection instead if "hang_up"
+// is set, run on a thread of its own until "done" is set
+std::thread slow_server(std::string const& port,
+                        std::chrono::milliseconds delay,
+                        std::vector<uint8_t> answer, bool hang_up,
+                        std::atomic<bool>& done) {
+    auto srv = std::make_shared<TcpServer>(64);
+    srv->bind(port);
+    srv->on_message([=](TcpServer& srv, TcpConnection id,
+                        std::vector<uint8_t>&& message) {
+        std::this_thread::sleep_for(delay);
+        if (hang_up) {
+            srv.close(id);
+        } else {
+            srv.send(id, answer.empty() ? message : answer);
+        }
+    });
+    return std::thread([srv, &done] {
+        while (!done) {
+            srv->run_once(10);
+        }
+    });
+}
+
+// A hedged request gets the answer of the fast backend whichever one it was
+// sent to first, and falls back on the other backend if the first one to
+// answer fails
+void hedged_requests() {
+    std::vector<uint8_t> data(10, 4);
+    std::vector<uint8_t> late(10, 8);
+    std::atomic<bool> done(false);
+    auto slow = slow_server("1253", std::chrono::milliseconds(300), late,
+                            false, done);
+    auto fast = slow_server("1254", std::chrono::milliseconds(0), {}, false,
+                            done);
+    auto failing = slow_server("1255", std::chrono::milliseconds(50), {},
+                               true, done);
+    auto lagging = slow_server("1256", std::chrono::milliseconds(100), {},
+                               false, done);
+
+    try {
+        TcpBalancer balancer({{"localhost", "1253"}, {"localhost", "1254"}});
+        for (auto i = 0; i < 6; i++) {
+            auto start = std::chrono::steady_clock::now();
+            if (balancer.hedged_request(data, std::chrono::milliseconds(20)) !=
+                data) {
+                fail("hedged request didn't get the fast answer");
+            }
+            if (std::chrono::steady_clock::now() - start >
+                std::chrono::milliseconds(200)) {
+                fail("hedged request waited for the slow backend");
+            }
+        }
+        // Timed from when it was sent the request, not from the hedge delay
+        if (balancer.latency(1) > std::chrono::milliseconds(15)) {
+            fail("hedged backend charged with the hedge delay");
+        }
+
+        // Whichever backend is tried first, the failing one hangs up before
+        // the other one answers
+        TcpBalancer fallback({{"localhost", "1255"}, {"localhost", "1256"}});
+        for (auto i = 0; i < 4; i++) {
+            if (fallback.hedged_request(data, std::chrono::milliseconds(20)) !=
+                data) {
+                fail("hedged request didn't fall back on the other backend");
+            }
+        }
+        if (fallback.in_flight(0) != 0 || fallback.in_flight(1) != 0) {
+            fail("hedged requests left requests in flight");
+        }
+    } catch (TcpError err) {
+        fail("hedged request error " + err.message);
+    }
+
+    done = true;
+    for (auto thread : {&slow, &fast, &failing, &lagging}) {
+        thread->join();
+    }
+}
+
+// A backend that lost a hedged request answers the next one without the late
+// response to the hedged one holding it up
+void stale_hedge() {
+    std::vector<uint8_t> data(10, 5);
+    std::atomic<bool> done(false);
+    auto fast = slow_server("1257", std::chrono::milliseconds(0), {}, false,
+                            done);
+    // Answers its first request late without blocking the other ones
+    TcpServer srv(64);
+    srv.bind("1258");
+    std::optional<TcpConnection> first;
+    std::vector<uint8_t> answer;
+    auto deadline = std::chrono::steady_clock::now();
+    auto answered = false;
+    srv.on_message([&](TcpServer& srv, TcpConnection id,
+                       std::vector<uint8_t>&& message) {
+        if (!answered && !first.has_value()) {
+            first = id;
+            answer = std::move(message);
+            deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(400);
+        } else {
+            srv.send(id, message);
+        }
+    });
+    std::thread late([&] {
+        while (!done) {
+            srv.run_once(10);
+            if (first.has_value() &&
+                std::chrono::steady_clock::now() > deadline) {
+                srv.send(*first, answer);
+                first = std::nullopt;
+                answered = true;
+            }
+        }
+    });
+
+    try {
+        TcpBalancer balancer({{"localhost", "1258"}, {"localhost", "1257"}});
+        // Until the late backend is picked first and loses to the other one
+        for (auto i = 0; i < 50 && balancer.in_flight(0) == 0; i++) {
+            if (balancer.hedged_request(data, std::chrono::milliseconds(20)) !=
+                data) {
+                fail("hedged request didn't get the fast answer");
+            }
+        }
+        if (balancer.in_flight(0) == 0) {
+            fail("late backend never lost a hedged request");
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        if (balancer.request(0, data) != data) {
+            fail("request after a lost hedge got the wrong answer");
+        }
+        if (std::chrono::steady_clock::now() - start >
+            std::chrono::milliseconds(200)) {
+            fail("request waited for the response to a lost hedge");
+        }
+        if (balancer.in_flight(0) != 0) {
+            fail("lost hedge left a request in flight");
+        }
+    } catch (TcpError err) {
+        fail("stale hedge error " + err.message);
+    }
+
+    done = true;
+    fast.join();
+    late.join();
+}
+
+// With preempting enabled, a message sent while a lower priority one is being
+// written goes in the middle of it, and both arrive intact
+void preempted_send() {
+    std::vector<uint8_t> bulk(2000000);
+    for (size_t i = 0; i < bulk.size(); i++) {
+        bulk[i] = i * 13;
+    }
+    std::vector<uint8_t> heartbeat(10, 9);
+
+    std::thread sender([&] {
+        try {
+            TcpSocket sck(64);
+            sck.bind("0");
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            sck.connect("localhost", "1248");
+            sck.set_preempting(true);
+            // Slow enough for the bulk message to still be written when the
+            // heartbeat comes
+            sck.set_rate_limit(0, 8e6, 1 << 16);
+
+            std::thread bulk_sender([&] { sck.send(bulk, 0); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            sck.send(heartbeat, 1);
+            bulk_sender.join();
+        } catch (TcpError err) {
+            fail("preempting sender error " + err.message);
+        }
+    });
+
+    TcpSocket sck(64);
+    sck.bind("1248");
+    sck.accept();
+    if (sck.recv() != heartbeat) {
+        fail("heartbeat didn't preempt the bulk message");
+    }
+    if (sck.recv() != bulk) {
+        fail("preempted message corrupted");
+    }
+    sender.join();
+}
+
+// A message an urgent one interrupted is forgotten with its connection,
+// rather than prepended to the first message of the next one
+void interrupted_reconnect() {
+    std::vector<uint8_t> urgent(10, 5);
+    std::vector<uint8_t> clean(20, 6);
+
+    std::thread sender([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // A full packet of a message, then an urgent one inside it, and the
+        // connection dropping before the rest of the message
+        std::vector<uint8_t> packets(3 * 64);
+        packets[0] = 63;
+        TcpPacketEncoder::encode_urgent(64, urgent.size(),
+                                        packets.data() + 64);
+        size_t offset = 0;
+        TcpPacketEncoder::encode(64, urgent, offset, 1, packets.data() + 128);
+        auto fd = connect_raw("1251");
+        send(fd, packets.data(), packets.size(), MSG_NOSIGNAL);
+        close(fd);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        try {
+            TcpSocket sck(64);
+            sck.bind("0");
+            sck.connect("localhost", "1251");
+            sck.send(clean);
+        } catch (TcpError err) {
+            fail("reconnecting sender error " + err.message);
+        }
+    });
+
+    try {
+        TcpSocket sck(64);
+        sck.bind("1251");
+        sck.accept();
+        if (sck.recv() != urgent) {
+            fail("urgent message corrupted");
+        }
+        sck.disconnect();
+        sck.accept();
+        if (sck.recv() != clean) {
+            fail("message received after reconnecting isn't clean");
+        }
+    } catch (TcpError err) {
+        fail("interrupted receiver error " + err.message);
+    }
+    sender.join();
+}
+
+// Packets of a message, behind a control packet of kind "header" carrying its
+// size unless "header" is 0
+std::vector<uint8_t> packets_of(uint8_t packet_len,
+                                std::vector<uint8_t> const& message,
+                                uint8_t header) {
+    auto count = TcpPacketEncoder::packets(packet_len, message.size());
+    std::vector<uint8_t> packets((count + (header != 0)) * packet_len);
+    auto out = packets.data();
+    if (header != 0) {
+        TcpPacketEncoder::encode_announce(packet_len, message.size(), out);
+        out[1] = header;
+        out += packet_len;
+    }
+    size_t offset = 0;
+    TcpPacketEncoder::encode(packet_len, message, offset, count, out);
+    return packets;
+}
+
+// Plain, announced and urgent messages get through a relay whose source
+// changes its packet length, to a destination adapting its own length and
+// sending messages of its own at the same time
+void relayed_resize() {
+    std::vector<uint8_t> plain(100, 1);
+    std::vector<uint8_t> announced(8000000);
+    for (size_t i = 0; i < announced.size(); i++) {
+        announced[i] = i * 7;
+    }
+    std::vector<uint8_t> urgent(20, 3);
+    std::vector<uint8_t> interrupted(100, 4);
+    std::vector<uint8_t> direct(1000, 5);
+    std::vector<uint8_t> last(10, 6);
+
+    std::thread sender([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        auto packets = packets_of(64, plain, 0);
+        std::vector<uint8_t> resize(64);
+        TcpPacketEncoder::encode_resize(64, 32, resize.data());
+        packets.insert(packets.end(), resize.begin(), resize.end());
+        auto more = packets_of(32, announced, TcpPacketEncoder::announce);
+        packets.insert(packets.end(), more.begin(), more.end());
+        // The urgent message after the first packet of the other one
+        more = packets_of(32, interrupted, 0);
+        auto inside = packets_of(32, urgent, TcpPacketEncoder::urgent);
+        more.insert(more.begin() + 32, inside.begin(), inside.end());
+        packets.insert(packets.end(), more.begin(), more.end());
+
+        auto fd = connect_raw("1263");
+        send(fd, packets.data(), packets.size(), MSG_NOSIGNAL);
+        close(fd);
+    });
+
+    std::vector<std::vector<uint8_t>> relayed;
+    std::thread receiver([&] {
+        try {
+            TcpSocket sck(64);
+            sck.bind("1264");
+            sck.accept();
+            // Until the relay and the other writer both wait for room
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            while (true) {
+                auto message = sck.recv();
+                if (message == last) {
+                    break;
+                } else if (message != direct) {
+                    relayed.push_back(std::move(message));
+                }
+            }
+        } catch (TcpError err) {
+            fail("relay receiver error " + err.message);
+        }
+    });
+
+    try {
+        TcpSocket src(64);
+        src.bind("1263");
+        TcpSocket dst(64);
+        dst.set_adaptive_packet_len(3, 255);
+        dst.bind("0");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        dst.connect("localhost", "1264");
+        src.accept();
+
+        std::atomic<bool> done(false);
+        std::atomic<bool> sending(false);
+        std::thread own([&] {
+            try {
+                while (!done) {
+                    dst.send(direct);
+                    sending = true;
+                }
+            } catch (TcpError err) {
+                fail("relay destination error " + err.message);
+            }
+        });
+        while (!sending) {
+            std::this_thread::yield();
+        }
+        try {
+            TcpRelay relay;
+            for (auto i = 0; i < 3; i++) {
+                relay.forward(src, dst);
+            }
+        } catch (TcpError err) {
+            fail("relay error " + err.message);
+        }
+        done = true;
+        own.join();
+        dst.send(last);
+    } catch (TcpError err) {
+        fail("relay setup error " + err.message);
+    }
+    sender.join();
+    receiver.join();
+
+    if (relayed != std::vector<std::vector<uint8_t>>{plain, announced, urgent,
+                                                     interrupted}) {
+        fail("relayed messages corrupted");
+    }
+}
+
+// A connection with far more queued than its budget lets through in a round
+// doesn't hold up another one sending a single message
+void fair_rounds() {
+    std::vector<uint8_t> flood(1000, 1);
+    std::vector<uint8_t> quiet(10, 2);
+    size_t flooded = 0;
+    std::optional<size_t> flooded_before;
+
+    TcpServer srv(64);
+    srv.bind("1265");
+    srv.set_budget(4096, 4);
+    srv.on_message([&](TcpServer&, TcpConnection,
+                       std::vector<uint8_t>&& message) {
+        if (message == quiet) {
+            flooded_before = flooded;
+        } else {
+            flooded++;
+        }
+    });
+
+    // As many messages as the socket buffers take
+    auto packets = packets_of(64, flood, 0);
+    auto flooder = connect_raw("1265");
+    size_t sent = 0;
+    while (send(flooder, packets.data(), packets.size(),
+                MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)packets.size()) {
+        sent++;
+    }
+    if (sent < 100) {
+        fail("flooding connection couldn't queue enough messages");
+    }
+    packets = packets_of(64, quiet, 0);
+    auto sender = connect_raw("1265");
+    send(sender, packets.data(), packets.size(), MSG_NOSIGNAL);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    for (auto i = 0; i < 10 && !flooded_before.has_value(); i++) {
+        srv.run_once(100);
+    }
+    if (!flooded_before.has_value()) {
+        fail("flooding connection starved the other one");
+    } else if (*flooded_before > 2 * 4) {
+        fail("flooding connection got more than its share before the other "
+             "one");
+    }
+    close(flooder);
+    close(sender);
+}
+
+// The handle of a closed connection is refused once its slot went to a new
+// connection, nothing sent or done with it reaching the new one
+void stale_handle() {
+    std::vector<uint8_t> first(10, 1);
+    std::vector<uint8_t> second(10, 2);
+    std::vector<uint8_t> stale(10, 3);
+    std::vector<uint8_t> fresh(10, 4);
+
+    try {
+        TcpServer srv(64);
+        srv.bind("1266");
+        std::optional<TcpConnection> last;
+        srv.on_message([&](TcpServer& srv, TcpConnection id,
+                           std::vector<uint8_t>&& message) {
+            last = id;
+            srv.send(id, message);
+        });
+        // Closed connections are only let go of at the end of an iteration
+        auto run_until = [&](std::function<bool()> done) {
+            for (auto i = 0; i < 100; i++) {
+                srv.run_once(10);
+                if (done()) {
+                    break;
+                }
+            }
+        };
+
+        TcpSocket client(64);
+        client.bind("0");
+        client.connect("localhost", "1266");
+        client.send(first);
+        run_until([&] { return last.has_value(); });
+        if (!last.has_value() || client.recv() != first) {
+            fail("first connection not served");
+        }
+        auto old = *last;
+        srv.close(old);
+        run_until([&] { return srv.size() == 0; });
+        client.disconnect();
+
+        client.connect("localhost", "1266");
+        client.send(second);
+        run_until([&] { return *last != old; });
+        if (*last == old || (uint32_t)*last != (uint32_t)old) {
+            fail("new connection didn't take the slot of the closed one");
+        }
+        auto current = *last;
+
+        if (srv.send(old, stale)) {
+            fail("message sent with a stale handle");
+        }
+        srv.close(old);
+        if (!srv.send(current, fresh)) {
+            fail("new connection closed with a stale handle");
+        }
+        run_until([] { return true; });
+        if (srv.size() != 1) {
+            fail("new connection closed with a stale handle");
+        }
+        if (client.recv() != second || client.recv() != fresh) {
+            fail("message sent with a stale handle reached the new "
+                 "connection");
+        }
+    } catch (TcpError err) {
+        fail("stale handle error " + err.message);
+    }
+}
+
+// A connection migrating to another server in the middle of a message gets
+// it through intact, and replies keep going to the right peers
+void migrated_connection() {
+    std::vector<uint8_t> hello(10, 1);
+    std::vector<uint8_t> message(1000);
+    for (size_t i = 0; i < message.size(); i++) {
+        message[i] = i * 3;
+    }
+    std::vector<uint8_t> other(10, 2);
+
+    try {
+        TcpServer first(64);
+        TcpServer second(64);
+        first.bind("1267");
+        std::optional<TcpConnection> moving;
+        auto echo = [&](TcpServer& srv, TcpConnection id,
+                        std::vector<uint8_t>&& message) {
+            if (&srv == &first && message == hello) {
+                moving = id;
+            }
+            srv.send(id, message);
+        };
+        first.on_message(echo);
+        second.on_message(echo);
+        std::optional<TcpConnection> previous;
+        second.on_migrate([&](TcpServer&, TcpConnection, TcpConnection id) {
+            previous = id;
+        });
+
+        TcpSocket staying(64);
+        staying.bind("0");
+        staying.connect("localhost", "1267");
+
+        // The message is cut in the middle of a packet
+        auto expected = packets_of(64, hello, 0);
+        auto packets = packets_of(64, message, 0);
+        auto cut = packets.size() / 2 + 20;
+        auto head = expected;
+        head.insert(head.end(), packets.begin(), packets.begin() + cut);
+        expected.insert(expected.end(), packets.begin(), packets.end());
+        auto mover = connect_raw("1267");
+        send(mover, head.data(), head.size(), MSG_NOSIGNAL);
+        for (auto i = 0; i < 100 && !moving.has_value(); i++) {
+            first.run_once(10);
+        }
+        if (!moving.has_value()) {
+            fail("migrating connection not served");
+        }
+
+        if (!first.migrate(*moving, second)) {
+            fail("couldn't migrate connection");
+        }
+        first.run_once(0);
+        if (first.send(*moving, other)) {
+            fail("migrated connection still served by its old server");
+        }
+
+        send(mover, packets.data() + cut, packets.size() - cut, MSG_NOSIGNAL);
+        staying.send(other);
+        std::vector<uint8_t> received(expected.size());
+        size_t offset = 0;
+        for (auto i = 0; i < 100 && offset < received.size(); i++) {
+            first.run_once(10);
+            second.run_once(10);
+            auto got = recv(mover, received.data() + offset,
+                            received.size() - offset, MSG_DONTWAIT);
+            offset += got > 0 ? got : 0;
+        }
+        if (previous != moving) {
+            fail("migration not reported with the previous handle");
+        }
+        if (received != expected) {
+            fail("message corrupted by migrating");
+        }
+        if (staying.recv() != other) {
+            fail("reply to the connection left behind went astray");
+        }
+        close(mover);
+    } catch (TcpError err) {
+        fail("migration error " + err.message);
+    }
+}
+
+// Connections all landing on one server of a group get spread over the
+// others while busy, without a message getting lost or corrupted
+void rebalanced_group() {
+    TcpServerGroup group(64, 2);
+    std::atomic<size_t> migrations(0);
+    group.on_message([](TcpServer& srv, TcpConnection id,
+                        std::vector<uint8_t>&& message) {
+        srv.send(id, message);
+    });
+    group.on_migrate([&](TcpServer&, TcpConnection, TcpConnection) {
+        migrations++;
+    });
+    group.set_rebalancing(std::chrono::milliseconds(20), 2.0);
+    group.bind("1268");
+    group.start();
+
+    std::vector<std::thread> clients;
+    for (auto client = 0; client < 4; client++) {
+        clients.emplace_back([&, client] {
+            // Steered to the first server, from its CPU
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(group.cpu(0), &set);
+            pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+
+            try {
+                TcpSocket sck(64);
+                sck.bind("0");
+                sck.connect("localhost", "1268");
+                std::vector<uint8_t> message(5000);
+                for (auto i = 0; i < 500; i++) {
+                    for (size_t j = 0; j < message.size(); j++) {
+                        message[j] = client * 31 + i + j;
+                    }
+                    sck.send(message);
+                    if (sck.recv() != message) {
+                        fail("message corrupted while rebalancing");
+                    }
+                }
+            } catch (TcpError err) {
+                fail("rebalanced client error " + err.message);
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    group.stop();
+
+    if (migrations == 0) {
+        fail("busy server never gave connections away");
+    }
+}
+
+// Fresh directory for a test to keep files in
+std::string temp_dir() {
+    char path[] = "/tmp/nix_tcp_test_XXXXXX";
+    if (mkdtemp(path) == nullptr) {
+        fail("couldn't create a temporary directory");
+    }
+    return path;
+}
+
+// Delete a directory created by "temp_dir" along with its files
+void remove_dir(std::string const& path) {
+    if (auto dir = opendir(path.c_str())) {
+        while (auto entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name != "." && name != "..") {
+                unlink((path + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path.c_str());
+}
+
+// Message "i" of the spool tests, "size" bytes long
+std::vector<uint8_t> spooled(int i, size_t size) {
+    std::vector<uint8_t> message(size);
+    for (size_t j = 0; j < size; j++) {
+        message[j] = i * 31 + j;
+    }
+    return message;
+}
+
+// Whether the front of a spool is message "i"
+bool front_is(TcpSpool& spool, int i, size_t size) {
+    auto front = spool.front();
+    return front.has_value() &&
+           std::vector<uint8_t>(front->data, front->data + front->size) ==
+               spooled(i, size);
+}
+
+// Reopening a spool keeps the messages left to deliver, in order, and
+// forgets delivered ones
+void spool_reopen() {
+    auto dir = temp_dir();
+    {
+        TcpSpool spool(dir, 4096, 4, 0);
+        for (auto i = 0; i < 3; i++) {
+            spool.append(spooled(i, 100));
+        }
+        spool.pop();
+    }
+    {
+        TcpSpool spool(dir, 4096, 4, 0);
+        if (spool.size() != 2 || !front_is(spool, 1, 100)) {
+            fail("reopened spool lost or kept the wrong messages");
+        }
+        spool.pop();
+        if (!front_is(spool, 2, 100)) {
+            fail("reopened spool out of order");
+        }
+    }
+    remove_dir(dir);
+}
+
+// A message whose record was torn or corrupted ends the spool on recovery,
+// and new messages go in its place
+void spool_torn_tail() {
+    auto dir = temp_dir();
+    {
+        TcpSpool spool(dir, 4096, 4, 0);
+        spool.append(spooled(0, 100));
+        spool.append(spooled(1, 100));
+    }
+
+    // Flip a byte of the second message: after the 16 bytes of header, the
+    // first record and the size and checksum of the second
+    auto fd = open((dir + "/0000000000000000.spool").c_str(), O_RDWR);
+    uint8_t byte;
+    auto offset = 16 + 112 + 8 + 50;
+    if (fd == -1 || pread(fd, &byte, 1, offset) != 1) {
+        fail("couldn't read spool segment");
+    }
+    byte ^= 0xff;
+    if (pwrite(fd, &byte, 1, offset) != 1) {
+        fail("couldn't corrupt spool segment");
+    }
+    close(fd);
+
+    {
+        TcpSpool spool(dir, 4096, 4, 0);
+        if (spool.size() != 1 || !front_is(spool, 0, 100)) {
+            fail("spool kept a corrupted message");
+        }
+        spool.append(spooled(2, 100));
+    }
+    {
+        TcpSpool spool(dir, 4096, 4, 0);
+        spool.pop();
+        if (spool.size() != 1 || !front_is(spool, 2, 100)) {
+            fail("message appended after a torn one was lost");
+        }
+    }
+    remove_dir(dir);
+}
+
+// Messages spread over several segments come out in order, delivered
+// segments are deleted, and the spool refuses messages once full
+void spool_rotation() {
+    auto dir = temp_dir();
+    {
+        // Four 1000 byte messages to a segment
+        TcpSpool spool(dir, 4096, 3, 0);
+        auto appended = 0;
+        while (spool.append(spooled(appended, 1000))) {
+            appended++;
+        }
+        if (appended != 12 || spool.disk_usage() != 3 * 4096) {
+            fail("spool of 3 segments took " + std::to_string(appended) +
+                 " messages");
+        }
+
+        for (auto i = 0; i < 5; i++) {
+            if (!front_is(spool, i, 1000)) {
+                fail("spool out of order across segments");
+            }
+            spool.pop();
+        }
+        // The first segment was delivered, which makes room for another
+        if (spool.disk_usage() != 2 * 4096 ||
+            !spool.append(spooled(12, 1000))) {
+            fail("spool didn't rotate out a delivered segment");
+        }
+    }
+    {
+        TcpSpool spool(dir, 4096, 3, 0);
+        for (auto i = 5; i <= 12; i++) {
+            if (!front_is(spool, i, 1000)) {
+                fail("reopened spool out of order across segments");
+            }
+            spool.pop();
+        }
+        if (!spool.empty() || spool.disk_usage() != 4096) {
+            fail("emptied spool kept its segments");
+        }
+    }
+    remove_dir(dir);
+}
+
+// Messages sent while disconnected are delivered in order on reconnecting
+void spool_reconnect() {
+    auto dir = temp_dir();
+    std::thread receiver([&] {
+        try {
+            TcpSocket sck(64);
+            sck.bind("1252");
+            sck.accept();
+            for (auto i = 0; i < 10; i++) {
+                if (sck.recv() != spooled(i, 100 + i)) {
+                    fail("spooled message " + std::to_string(i) +
+                         " delivered out of order or corrupted");
+                }
+            }
+        } catch (TcpError err) {
+            fail("spool receiver error " + err.message);
+        }
+    });
+
+    try {
+        TcpSpool spool(dir, 4096, 4, 0);
+        TcpSocket sck(64);
+        sck.bind("0");
+        sck.spool_to(spool);
+        for (auto i = 0; i < 5; i++) {
+            sck.send(spooled(i, 100 + i));
+        }
+        if (spool.size() != 5) {
+            fail("messages sent while disconnected weren't spooled");
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        sck.connect("localhost", "1252");
+        for (auto i = 5; i < 10; i++) {
+            sck.send(spooled(i, 100 + i));
+        }
+        receiver.join();
+        if (!spool.empty()) {
+            fail("spool not drained on reconnecting");
+        }
+    } catch (TcpError err) {
+        fail("spool sender error " + err.message);
+    }
+    remove_dir(dir);
+}
+
+// Every kernel the CPU supports gives the same results as the baseline ones,
+// for short packets, odd sizes and buffers at any alignment
+void kernel_equivalence() {
+    std::mt19937 rng(42);
+    auto baseline = TcpKernels::pick(TcpCpu::baseline);
+
+    std::vector<uint8_t> check = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    if (baseline.crc32c(check.data(), check.size()) != 0xe3069283) {
+        fail("baseline crc32c doesn't match the check value");
+    }
+
+    for (auto level = 1; level <= TcpCpu::supported(); level++) {
+        auto kernels = TcpKernels::pick((TcpCpu::Level)level);
+        auto name = std::string(TcpCpu::name((TcpCpu::Level)level));
+
+        for (auto round = 0; round < 2000; round++) {
+            // Lengths below 16 and 32 bytes, narrower than vectors, come up
+            // as often as longer ones
+            uint8_t packet_len = round % 3 == 0   ? 3 + rng() % 13
+                                 : round % 3 == 1 ? 16 + rng() % 16
+                                                  : 3 + rng() % 253;
+            size_t size = rng() % 5000;
+            auto align = rng() % 32;
+            std::vector<uint8_t> data(size + align);
+            for (auto& byte : data) {
+                byte = rng();
+            }
+            auto message = data.data() + align;
+
+            // Encode from some offset into the message, maybe not all of it
+            size_t start = size == 0 ? 0 : rng() % size;
+            size_t max_packets = rng() % 2 ? SIZE_MAX : 1 + rng() % 50;
+            auto wire_len =
+                TcpPacketEncoder::packets(packet_len, size) * packet_len;
+            auto out_align = rng() % 32;
+            std::vector<uint8_t> expected(wire_len + out_align + 64, 0xaa);
+            auto actual = expected;
+            auto expected_offset = start;
+            auto actual_offset = start;
+            auto expected_len =
+                baseline.encode(packet_len, message, size, expected_offset,
+                                max_packets, expected.data() + out_align);
+            auto actual_len =
+                kernels.encode(packet_len, message, size, actual_offset,
+                               max_packets, actual.data() + out_align);
+            if (actual_len != expected_len ||
+                actual_offset != expected_offset || actual != expected) {
+                fail(name + " encode differs from baseline for " +
+                     std::to_string(size) + " bytes in packets of " +
+                     std::to_string(packet_len));
+            }
+
+            // Strip the packets of the whole message
+            size_t offset = 0;
+            std::vector<uint8_t> wire(wire_len + out_align);
+            baseline.encode(packet_len, message, size, offset, SIZE_MAX,
+                            wire.data() + out_align);
+            auto packets = TcpPacketEncoder::packets(packet_len, size);
+            auto stripped = wire;
+            if (!kernels.strip(packet_len, stripped.data() + out_align,
+                               packets, size) ||
+                !std::equal(message, message + size,
+                            stripped.begin() + out_align)) {
+                fail(name + " strip differs from baseline for " +
+                     std::to_string(size) + " bytes in packets of " +
+                     std::to_string(packet_len));
+            }
+            // Both refuse a wrong chunk length
+            if (packets > 0) {
+                auto corrupted = wire;
+                corrupted[out_align + rng() % packets * packet_len] ^= 1;
+                auto copy = corrupted;
+                if (kernels.strip(packet_len, corrupted.data() + out_align,
+                                  packets, size) !=
+                    baseline.strip(packet_len, copy.data() + out_align,
+                                   packets, size)) {
+                    fail(name + " strip disagrees on a wrong chunk length");
+                }
+            }
+
+            // Checksums of unaligned ranges of any length
+            auto crc_len = rng() % (size + 1);
+            if (kernels.crc32c(message, crc_len) !=
+                baseline.crc32c(message, crc_len)) {
+                fail(name + " crc32c differs from baseline for " +
+                     std::to_string(crc_len) + " bytes");
+            }
+        }
+    }
+}
+
+// An acceptor whose servers never take connections drops the ones they have
+// no room for, and can still be stopped
+void stuck_acceptor() {
+    // Enough descriptors for both ends of more connections than a server
+    // inbox holds
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = std::min(limit.rlim_max, (rlim_t)4096);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < 4096) {
+        std::cout << "skipping stuck acceptor test, too few descriptors"
+                  << std::endl;
+        return;
+    }
+
+    try {
+        // The server never runs
+        TcpServer srv(64);
+        TcpAcceptor acceptor({&srv});
+        acceptor.bind("1249");
+        acceptor.start();
+
+        // The inbox of the server holds 1024 connections
+        std::vector<int> clients;
+        for (auto i = 0; i < 1030; i++) {
+            clients.push_back(connect_raw("1249"));
+        }
+
+        // The first client left over gets its connection closed
+        struct pollfd closed = {clients[1024], POLLIN, 0};
+        if (poll(&closed, 1, 2000) != 1) {
+            fail("acceptor kept a connection no server took");
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        acceptor.stop();
+        if (std::chrono::steady_clock::now() - start >
+            std::chrono::seconds(1)) {
+            fail("acceptor took too long to stop");
+        }
+        for (auto fd : clients) {
+            close(fd);
+        }
+    } catch (TcpError err) {
+        fail("acceptor error " + err.message);
+    }
+}
+
+// Messages recorded by sockets and a server, in both directions and on
+// several connections, read back as they were recorded, including once the
+// capture file had to grow
+void capture_round_trip() {
+    auto dir = temp_dir();
+    auto path = dir + "/capture";
+    // Connection recorded, as the index of the client and whether it is the
+    // server end, with its direction and message. Messages recorded directly
+    // are from client 3
+    struct Expected {
+        int client;
+        bool server;
+        TcpCapture::Direction direction;
+        std::vector<uint8_t> data;
+    };
+    std::vector<Expected> expected;
+
+    try {
+        TcpCapture capture(path);
+        TcpServer srv(64);
+        srv.bind("1269");
+        srv.record(capture);
+        size_t handled = 0;
+        srv.on_message([&](TcpServer& srv, TcpConnection id,
+                           std::vector<uint8_t>&& message) {
+            std::reverse(message.begin(), message.end());
+            srv.send(id, message);
+            handled++;
+        });
+
+        std::vector<std::unique_ptr<TcpSocket>> clients;
+        for (auto i = 0; i < 3; i++) {
+            clients.emplace_back(new TcpSocket(64));
+            clients.back()->bind("0");
+            clients.back()->connect("localhost", "1269");
+            clients.back()->record(capture);
+        }
+
+        auto exchange = [&](int round) {
+            for (auto i = 0; i < 3; i++) {
+                auto message = spooled(round * 3 + i, 10 + 100 * i);
+                auto reply = message;
+                std::reverse(reply.begin(), reply.end());
+                clients[i]->send(message);
+                expected.push_back({i, false, TcpCapture::sent, message});
+                auto target = handled + 1;
+                for (auto j = 0; j < 100 && handled < target; j++) {
+                    srv.run_once(10);
+                }
+                expected.push_back({i, true, TcpCapture::received, message});
+                expected.push_back({i, true, TcpCapture::sent, reply});
+                if (clients[i]->recv() != reply) {
+                    fail("captured exchange corrupted");
+                }
+                expected.push_back({i, false, TcpCapture::received, reply});
+            }
+        };
+        exchange(0);
+        exchange(1);
+
+        // Larger than what the file grows by at once, then enough to grow it
+        // in steps
+        auto before = capture.size();
+        auto id = capture.connection();
+        for (auto size : {(size_t)40 << 20, (size_t)7 << 20, (size_t)7 << 20}) {
+            auto message = spooled(size, size);
+            capture.record(id, TcpCapture::sent, message);
+            expected.push_back({3, false, TcpCapture::sent, message});
+        }
+        if (capture.size() < before + (54 << 20)) {
+            fail("capture didn't grow");
+        }
+        exchange(2);
+    } catch (TcpError err) {
+        fail("capture error " + err.message);
+    }
+
+    try {
+        TcpCaptureReader reader(path);
+        // Identifiers seen for each end of each connection
+        std::map<std::pair<int, bool>, uint64_t> ids;
+        std::chrono::nanoseconds last(0);
+        for (auto& record : expected) {
+            auto read = reader.next();
+            if (!read.has_value()) {
+                fail("capture cut short");
+            }
+            auto end = std::make_pair(record.client, record.server);
+            auto known = ids.emplace(end, read->connection).first->second;
+            if (read->connection != known) {
+                fail("captured connection identifier changed");
+            }
+            if (read->direction != record.direction ||
+                read->size != record.data.size() ||
+                !std::equal(record.data.begin(), record.data.end(),
+                            read->data)) {
+                fail("captured message doesn't match");
+            }
+            if (read->time < last) {
+                fail("captured times out of order");
+            }
+            last = read->time;
+        }
+        if (reader.next().has_value()) {
+            fail("capture has extra records");
+        }
+
+        std::set<uint64_t> distinct;
+        for (auto& id : ids) {
+            distinct.insert(id.second);
+        }
+        if (ids.size() != 7 || distinct.size() != 7) {
+            fail("captured connections share identifiers");
+        }
+    } catch (TcpError err) {
+        fail("capture reader error " + err.message);
+    }
+    remove_dir(dir);
+}
+
+// Send an HTTP request on a connected socket and read the whole response
+std::string http_get(int fd, std::string const& path) {
+    auto request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof buffer, 0)) > 0) {
+        response.append(buffer, received);
+    }
+    close(fd);
+    return response;
+}
+
+// The metrics exporter waits for accept errors to clear up rather than
+// spinning on them, and answers unknown paths with a plain text 404
+void exporter_errors() {
+    TcpMetricsExporter exporter("1261");
+    // Listening starts on the exporter thread
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto first = connect_raw("1261");
+    auto second = socket(AF_INET, SOCK_STREAM, 0);
+
+    // Out of descriptors once done with the first scrape, the exporter can't
+    // accept the second one
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    auto lowered = limit;
+    lowered.rlim_cur = 3;
+    setrlimit(RLIMIT_NOFILE, &lowered);
+
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons(1261);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(second, (struct sockaddr*)&address, sizeof address) == -1) {
+        fail("couldn't connect to the exporter");
+    }
+    if (http_get(first, "/metrics").rfind("HTTP/1.1 200 OK\r\n", 0) != 0) {
+        fail("metrics not served");
+    }
+
+    struct rusage before;
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &before);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    getrusage(RUSAGE_SELF, &after);
+    auto cpu = [](struct rusage const& usage) {
+        return std::chrono::seconds(usage.ru_utime.tv_sec +
+                                    usage.ru_stime.tv_sec) +
+               std::chrono::microseconds(usage.ru_utime.tv_usec +
+                                         usage.ru_stime.tv_usec);
+    };
+    if (cpu(after) - cpu(before) > std::chrono::milliseconds(100)) {
+        fail("metrics exporter spun on accept errors");
+    }
+
+    setrlimit(RLIMIT_NOFILE, &limit);
+    auto response = http_get(second, "/metrics");
+    if (response.rfind("HTTP/1.1 200 OK\r\n", 0) != 0 ||
+        response.find("application/openmetrics-text") == std::string::npos) {
+        fail("metrics not served after accept errors");
+    }
+
+    response = http_get(connect_raw("1261"), "/nothing");
+    if (response.rfind("HTTP/1.1 404 Not Found\r\n", 0) != 0 ||
+        response.find("Content-Type: text/plain") == std::string::npos) {
+        fail("unknown path not answered with a plain text 404");
+    }
+}
+
+// Value of a line of the rendered metrics, given what it starts with
+uint64_t metric(std::string const& metrics, std::string const& line) {
+    auto at = metrics.find("\n" + line + " ");
+    if (at == std::string::npos) {
+        fail("no metric " + line);
+    }
+    return std::stoull(metrics.substr(at + line.size() + 2));
+}
+
+// Latencies land in the first bucket they don't exceed, powers of two
+// included, both in the rendered metrics and in what the exporter serves
+void metrics_buckets() {
+    auto name = std::string("nix_tcp_tx_ack_latency_seconds");
+    auto bucket = [&](std::string const& metrics, std::string const& le) {
+        return metric(metrics, name + "_bucket{le=\"" + le + "\"}");
+    };
+    auto before = TcpMetrics::render();
+
+    for (auto ns : {0, 1000, 2000, 2001, 1048576000}) {
+        TcpMetrics::observe(TcpMetrics::tx_ack_latency,
+                            std::chrono::nanoseconds(ns));
+    }
+    TcpMetrics::observe(TcpMetrics::tx_ack_latency, std::chrono::seconds(10));
+
+    auto after = TcpMetrics::render();
+    std::vector<std::pair<std::string, uint64_t>> expected = {
+        {"1e-06", 2}, {"2e-06", 3}, {"4e-06", 4}, {"0.524288", 4},
+        {"1.04858", 5}, {"+Inf", 6},
+    };
+    for (auto& [le, count] : expected) {
+        if (bucket(after, le) - bucket(before, le) != count) {
+            fail("wrong count in the " + le + " latency bucket");
+        }
+    }
+    if (metric(after, name + "_count") - metric(before, name + "_count") !=
+        6) {
+        fail("wrong latency count");
+    }
+    if (after.size() < 6 || after.substr(after.size() - 6) != "# EOF\n") {
+        fail("metrics don't end with # EOF");
+    }
+
+    TcpMetricsExporter exporter("1262");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto response = http_get(connect_raw("1262"), "/metrics");
+    auto head = response.find("\r\n\r\n");
+    if (head == std::string::npos) {
+        fail("metrics response cut short");
+    }
+    auto body = response.substr(head + 4);
+    if (metric(response, "Content-Length:") != body.size()) {
+        fail("metrics response length mismatch");
+    }
+    for (auto& [le, count] : expected) {
+        if (bucket(body, le) - bucket(before, le) != count) {
+            fail("wrong count in the served " + le + " latency bucket");
+        }
+    }
+}
+
+// A burst of slow requests from one congestion event shrinks the concurrency
+// limit once, while a slow request started after it shrinks it again
+void concurrency_backoff() {
+    TcpConcurrencyLimit limit(100, 1, 1024);
+    for (auto i = 0; i < 50; i++) {
+        limit.try_acquire();
+    }
+    for (auto i = 0; i < 10; i++) {
+        limit.release(std::chrono::milliseconds(1));
+    }
+    for (auto i = 0; i < 30; i++) {
+        limit.release(std::chrono::milliseconds(10));
+    }
+    if (limit.current() != 90) {
+        fail("burst of slow requests brought the limit to " +
+             std::to_string(limit.current()) + " instead of 90");
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    limit.release(std::chrono::milliseconds(10));
+    if (limit.current() != 81) {
+        fail("slow request after the decrease brought the limit to " +
+             std::to_string(limit.current()) + " instead of 81");
+    }
+}
+
+// Requests turned away by a concurrency limit or a full queue are counted,
+// and a queue whose delay stays above its target for longer than its interval
+// starts dropping requests, which are counted too
+void shed_requests() {
+    auto rejected = TcpMetrics::read(TcpMetrics::requests_rejected);
+    auto dropped = TcpMetrics::read(TcpMetrics::requests_dropped);
+
+    TcpConcurrencyLimit limit(1, 1, 1);
+    limit.try_acquire();
+    if (limit.try_acquire() ||
+        TcpMetrics::read(TcpMetrics::requests_rejected) - rejected != 1) {
+        fail("concurrency limit rejection not counted");
+    }
+
+    size_t shed = 0;
+    TcpCodelQueue<int> queue(200, std::chrono::milliseconds(5),
+                             std::chrono::milliseconds(100),
+                             [&](int&&) { shed++; });
+    for (auto i = 0; i < 200; i++) {
+        queue.push(i);
+    }
+    if (queue.push(200) ||
+        TcpMetrics::read(TcpMetrics::requests_rejected) - rejected != 2) {
+        fail("full queue rejection not counted");
+    }
+
+    // Every request waited longer than the target by the time it is popped
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&] { return std::chrono::steady_clock::now() - start; };
+    while (elapsed() < std::chrono::milliseconds(40)) {
+        queue.pop();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    if (queue.drops() != 0) {
+        fail("queue dropped requests before an interval above its target");
+    }
+    while (elapsed() < std::chrono::milliseconds(400) && queue.size() > 0 &&
+           queue.drops() == 0) {
+        queue.pop();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    if (queue.drops() == 0) {
+        fail("queue kept above its target never dropped requests");
+    }
+    if (shed != queue.drops() ||
+        TcpMetrics::read(TcpMetrics::requests_dropped) - dropped !=
+            queue.drops()) {
+        fail("dropped requests not counted");
+    }
+}
+
 int main() {
     std::thread t1(thread1);
     std::thread t2(thread2);
     t1.join();
     t2.join();
+
+    oversized_announcement();
+    adapted_reconnect();
+    rx_timestamps();
+    dead_backend();
+    hedged_requests();
+    stale_hedge();
+    preempted_send();
+    interrupted_reconnect();
+    relayed_resize();
+    fair_rounds();
+    stale_handle();
+    migrated_connection();
+    rebalanced_group();
+    stuck_acceptor();
+    spool_reopen();
+    spool_torn_tail();
+    spool_rotation();
+    spool_reconnect();
+    capture_round_trip();
+    concurrency_backoff();
+    shed_requests();
+    kernel_equivalence();
+    exporter_errors();
+    metrics_buckets();
+    std::cout << "ok" << std::endl;
 }